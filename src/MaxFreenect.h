@@ -2,158 +2,648 @@
 
 extern "C" {
 	#include "libfreenect.h"
+	#include "libfreenect_registration.h"
 }
 
-freenect_context * f_ctx = NULL;
-t_systhread capture_thread;	
-int capturing = 0;
+#ifdef __MACH__
+	#include <pthread.h>
+	#include <mach/mach.h>
+	#include <mach/thread_policy.h>
+#endif
+
+#define MAX_DEVICES 16
+// longest the event thread waits for USB events: it bounds how soon the thread notices
+// it should stop, and how often it polls accelerometers while no frames arrive:
+#define EVENT_TIMEOUT_MS 20
+// how long (ms) a frame may wait for its partner from the other stream, to be colored as a pair:
+#define PAIR_TOLERANCE_MS 16
+// how long (ms) a device listing is answered from before it is refreshed:
+#define DEVLIST_MAX_AGE 2000
+class t_kinect;
+
+// give the calling thread an affinity tag: threads with different tags are kept
+// on different cores where possible (macOS only; 0 leaves it to the scheduler):
+static void thread_affinity(long tag) {
+#ifdef __MACH__
+	if (tag <= 0) return;
+	thread_affinity_policy_data_t policy = { (integer_t)tag };
+	thread_policy_set(pthread_mach_thread_np(pthread_self()), THREAD_AFFINITY_POLICY, 
+		(thread_policy_t)&policy, THREAD_AFFINITY_POLICY_COUNT);
+#endif
+}
+
+// a freenect context, reference counted by the devices using it, and its event thread,
+// which runs for as long as the context exists. 
+// f_manager is shared by every object; a device with private_context owns one of its own.
+struct freenect_manager {
+	t_systhread_mutex mutex;	// guards everything below; created by the first object (main thread)
+	t_systhread_cond changed;	// signalled when the event thread has started, or been joined
+	freenect_context * ctx;
+	t_systhread	thread;
+	long		priority, affinity;	// of the event thread, given by whoever started it
+	int			refs;
+	volatile char running;		// the event thread keeps going while set
+	char		started;		// the event thread is handling events
+	char		stopping;		// the last reference is gone and the thread is being joined
+	t_kinect *	devices[MAX_DEVICES];	// open devices, whose accelerometers the event thread polls
+	
+	void init() {
+		if (mutex) return;
+		systhread_mutex_new(&mutex, 0);
+		systhread_cond_new(&changed, 0);
+	}
+	
+	// (only once nothing holds a reference)
+	void destroy() {
+		if (!mutex) return;
+		systhread_cond_free(changed);
+		systhread_mutex_free(mutex);
+		mutex = 0;
+	}
+	
+	// take a reference to the context, creating it (and starting its thread) if needed;
+	// the thread's priority & affinity are only applied when it starts.
+	// returns NULL on failure:
+	freenect_context * acquire(long thread_priority = 0, long thread_affinity = 0) {
+		systhread_mutex_lock(mutex);
+		// a context being shut down can't be reused; wait for it to go:
+		while (stopping) systhread_cond_wait(changed, mutex);
+		if (!ctx) {
+			if (freenect_init(&ctx, NULL) < 0) {
+				error("freenect_init() failed");
+				ctx = NULL;
+				systhread_mutex_unlock(mutex);
+				return NULL;
+			}
+			freenect_set_log_callback(ctx, log_cb);
+//			FREENECT_LOG_FATAL = 0,     /**< Log for crashing/non-recoverable errors */
+//			FREENECT_LOG_ERROR,         /**< Log for major errors */
+//			FREENECT_LOG_WARNING,       /**< Log for warning messages */
+//			FREENECT_LOG_NOTICE,        /**< Log for important messages */
+//			FREENECT_LOG_INFO,          /**< Log for normal messages */
+//			FREENECT_LOG_DEBUG,         /**< Log for useful development messages */
+//			FREENECT_LOG_SPEW,          /**< Log for slightly less useful messages */
+//			FREENECT_LOG_FLOOD,         /**< Log EVERYTHING. May slow performance. */
+			freenect_set_log_level(ctx, FREENECT_LOG_WARNING);
+			
+			running = 1;
+			priority = thread_priority;
+			affinity = thread_affinity;
+			if (systhread_create((method)&threadfunc, this, 0, priority, 0, &thread)) {
+				error("Failed to create freenect event thread.");
+				running = 0;
+				freenect_shutdown(ctx);
+				ctx = NULL;
+				systhread_mutex_unlock(mutex);
+				return NULL;
+			}
+			// don't hand out the context before its events are being handled:
+			while (!started) systhread_cond_wait(changed, mutex);
+		}
+		refs++;
+		freenect_context * result = ctx;
+		systhread_mutex_unlock(mutex);
+		return result;
+	}
+	
+	// drop a reference; the last one stops the event thread and shuts the context down:
+	void release() {
+		systhread_mutex_lock(mutex);
+		if (--refs > 0) {
+			systhread_mutex_unlock(mutex);
+			return;
+		}
+		running = 0;
+		stopping = 1;
+		systhread_mutex_unlock(mutex);
+		
+		// (the thread takes the mutex to poll devices, so join without it)
+		unsigned int ret;
+		systhread_join(thread, &ret);
+		
+		systhread_mutex_lock(mutex);
+		freenect_shutdown(ctx);
+		ctx = NULL;
+		thread = 0;
+		started = 0;
+		stopping = 0;
+		systhread_cond_broadcast(changed);
+		systhread_mutex_unlock(mutex);
+	}
+	
+	// add or remove an open device from the ones the event thread polls:
+	int attach(t_kinect * x) {
+		int ok = 0;
+		systhread_mutex_lock(mutex);
+		for (int i=0; i<MAX_DEVICES; i++) {
+			if (!devices[i]) {
+				devices[i] = x;
+				ok = 1;
+				break;
+			}
+		}
+		systhread_mutex_unlock(mutex);
+		return ok;
+	}
+	
+	void detach(t_kinect * x) {
+		systhread_mutex_lock(mutex);
+		for (int i=0; i<MAX_DEVICES; i++) {
+			if (devices[i] == x) devices[i] = NULL;
+		}
+		systhread_mutex_unlock(mutex);
+	}
+	
+	static void log_cb(freenect_context *dev, freenect_loglevel level, const char *msg) {
+		post(msg);
+	}
+	
+	static void *threadfunc(void *arg);
+};
+
+freenect_manager f_manager;
+
+// the devices found by the last enumeration, shared by every object.
+// getdevlist answers from it while it is fresh; otherwise it is refreshed on its own thread,
+// and the objects waiting are answered once that is done. so objects being created don't
+// each enumerate USB (which also needs a context of its own, the shared one may not exist).
+struct device_registry {
+	struct entry {
+		t_symbol *	serial;
+		long		model;		// 1414, or 1473 (whose camera reports an all-zero serial)
+	};
+	t_systhread_mutex mutex;	// guards everything below; created by the first object (main thread)
+	entry		devices[MAX_DEVICES];	// in the order freenect_open_device indexes them
+	int			count;
+	double		time;			// when they were listed (ms), 0 = never
+	char		refreshing;
+	t_systhread	thread;
+	t_kinect *	waiting;		// objects to answer once the refresh is done, linked by devlist_next
+	int			objects;		// the last to go joins the thread & frees the mutex
+	
+	// an object is created (main thread):
+	void init() {
+		if (!mutex) systhread_mutex_new(&mutex, 0);
+		systhread_mutex_lock(mutex);
+		objects++;
+		systhread_mutex_unlock(mutex);
+	}
+	
+	// is the listing fresh? if not, x is answered when it has been refreshed (main thread):
+	int request(t_kinect * x);
+	
+	// x is going away, don't answer it (main thread):
+	void forget(t_kinect * x);
+	
+	static void *threadfunc(void *arg);
+};
+
+device_registry d_registry;
 
 class t_kinect : public MaxKinectBase {
 public:
 
 	// freenect:
 	freenect_device  *device;
+	freenect_manager * manager;		// the context the device was opened with
+	freenect_manager own_manager;	// used instead of f_manager with private_context
+	void *		devlist_qelem;	// answers getdevlist once the registry is refreshed
+	t_kinect *	devlist_next;	// in the registry's waiting list
+	char		devlist_waiting;
+	
+	// frames are triple buffered between the USB callbacks and the processing thread:
+	// one being filled, the latest complete frame, and one being processed.
+	struct frame_buffers {
+		void *	buf[3];
+		long	size;		// bytes each buffer holds
+		int		format[3];	// stream format each buffer was filled with
+		double	time[3];	// host time (ms) each buffer's frame arrived
+		int		filling, ready, processing;
+		char	fresh;		// ready holds a frame the processing thread hasn't taken
+	};
 	
 	// internal data:
-	uint16_t *	depth_data;
+	frame_buffers depth_frames;
+	frame_buffers video_frames;
+	t_systhread_mutex frame_mutex;
+	t_systhread_cond frame_cond;
+	t_systhread	process_thread;
+	volatile char processing;
+	uint16_t *	depth_unpacked;	// staging for packed depth formats
+	uint16_t *	ir_unpacked;	// staging for packed infrared
+	freenect_registration registration_data;	// factory tables, copied once per open
+	freenect_depth_format depth_stream;	// format of the running depth stream
+	freenect_video_format video_stream;	// format of the running video stream
+	long		depth_stream_resolution;	// resolution of the running depth stream (-1 after a failed mode change)
+	long		video_stream_resolution;	// resolution of the running video stream (likewise)
+	int			video_processed;	// format of the video frame in the rgb/ir matrix, or -1
+	double		video_time;		// ... and when it arrived (ms)
 		
 	t_kinect() {	
 		device = 0;
+		f_manager.init();
+		memset(&own_manager, 0, sizeof(own_manager));
+		own_manager.init();
+		manager = &f_manager;
+		d_registry.init();
+		devlist_qelem = qelem_new(this, (method)devlist_qfn);
+		devlist_next = NULL;
+		devlist_waiting = 0;
+		depth_stream = FREENECT_DEPTH_MM;
+		video_stream = FREENECT_VIDEO_RGB;
+		depth_stream_resolution = video_stream_resolution = RESOLUTION_MEDIUM;
+		processing = 0;
+		process_thread = 0;
+		video_processed = -1;
+		video_time = 0;
 			
-		// depth buffer doesn't use a jit_matrix, because uint16_t is not a Jitter type:
-		depth_data = (uint16_t *)sysmem_newptr(DEPTH_WIDTH*DEPTH_HEIGHT * sizeof(uint16_t));
+		// depth buffers don't use a jit_matrix, because uint16_t is not a Jitter type.
+		// sized for the default modes; frames_reserve grows them for larger ones:
+		depth_frames.size = DEPTH_WIDTH*DEPTH_HEIGHT * sizeof(uint16_t);
+		video_frames.size = DEPTH_WIDTH*DEPTH_HEIGHT * sizeof(vec3c);
+		for (int i=0; i<3; i++) {
+			depth_frames.buf[i] = sysmem_newptr(depth_frames.size);
+			video_frames.buf[i] = sysmem_newptr(video_frames.size);
+		}
+		depth_frames.filling = video_frames.filling = 0;
+		depth_frames.ready = video_frames.ready = 1;
+		depth_frames.processing = video_frames.processing = 2;
+		depth_frames.fresh = video_frames.fresh = 0;
+		depth_unpacked = (uint16_t *)sysmem_newptr(DEPTH_WIDTH*DEPTH_HEIGHT * sizeof(uint16_t));
+		ir_unpacked = (uint16_t *)sysmem_newptr(DEPTH_WIDTH*IR_HEIGHT * sizeof(uint16_t));
+		systhread_mutex_new(&frame_mutex, 0);
+		systhread_cond_new(&frame_cond, 0);
 	}
 
 	~t_kinect() {
-		close();
+		control_stop();
+		close_device();
+		d_registry.forget(this);
+		qelem_free(devlist_qelem);
 		
-		sysmem_freeptr(depth_data);
+		for (int i=0; i<3; i++) {
+			sysmem_freeptr(depth_frames.buf[i]);
+			sysmem_freeptr(video_frames.buf[i]);
+		}
+		sysmem_freeptr(depth_unpacked);
+		sysmem_freeptr(ir_unpacked);
+		systhread_cond_free(frame_cond);
+		systhread_mutex_free(frame_mutex);
+		own_manager.destroy();
 	}
 	
+	// output the listing, as "devlist <serial>..." and a "device <index> <serial> <model>"
+	// for each device; from the registry straight away if it is fresh, otherwise once refreshed:
 	void getdevlist() {
-		t_atom a[8];
-		int i, flags;
-		struct freenect_device_attributes* attribute_list;
-		struct freenect_device_attributes* attribute;
+		if (d_registry.request(this)) devlist_output();
+	}
 	
-		// list devices:
-		if (!f_ctx) return;
+	static void devlist_qfn(t_kinect *x) {
+		x->devlist_output();
+	}
+	
+	void devlist_output() {
+		t_atom a[MAX_DEVICES];
+		device_registry::entry devices[MAX_DEVICES];
 		
-		int num_devices = freenect_list_device_attributes(f_ctx, &attribute_list);
+		systhread_mutex_lock(d_registry.mutex);
+		int num_devices = d_registry.count;
+		memcpy(devices, d_registry.devices, sizeof(devices));
+		systhread_mutex_unlock(d_registry.mutex);
 		
-		i = 0;
-		attribute = attribute_list;
-		while (attribute) {
-			atom_setsym(a+i, gensym(attribute->camera_serial));
-			attribute = attribute->next;
+		device_count = num_devices;
+		for (int i=0; i<num_devices; i++) {
+			atom_setsym(a+i, devices[i].serial);
 		}
 		outlet_anything(outlet_msg, gensym("devlist"), num_devices, a);
-		
-		freenect_free_device_attributes(attribute_list);
-		
-		//post("supported flags: %d", freenect_supported_subdevices());
+		for (int i=0; i<num_devices; i++) {
+			atom_setlong(a+0, i);
+			atom_setsym(a+1, devices[i].serial);
+			atom_setlong(a+2, devices[i].model);
+			outlet_anything(outlet_msg, gensym("device"), 3, a);
+		}
 	}
 	
 	
+	// open and close are carried out by the control thread, which reports the state:
 	void open(t_symbol *s, long argc, t_atom *argv) {
+		control_post(COMMAND_OPEN, argc, argv, (method)&control_threadfunc);
+	}
 	
-		if (device){
-			object_post(&ob, "A device is already open.");
-			return;
-		}
-		
-		// mark one additional device:
-		capturing++;
-		
-		if(!f_ctx){
-			long priority = 0; // maybe increase?
-			if (systhread_create((method)&capture_threadfunc, this, 0, priority, 0, &capture_thread)) {
-				object_error(&ob, "Failed to create capture thread.");
-				capturing = 0;
-				return;
-			}
-			while(!f_ctx){
-				systhread_sleep(0);
-			}
+	void close() {
+		control_post(COMMAND_CLOSE, 0, NULL, (method)&control_threadfunc);
+	}
+	
+	// control thread; returns 0 on failure:
+	int open_device(long argc, t_atom *argv) {
+		// the device holds a reference to its context while open:
+		manager = private_context ? &own_manager : &f_manager;
+		freenect_context * ctx = manager->acquire(event_priority, event_affinity);
+		if (!ctx) {
+			object_error(&ob, "failed to start freenect");
+			return 0;
 		}
 		
-		int ndevices = freenect_num_devices(f_ctx);
+		int ndevices = freenect_num_devices(ctx);
 		if(!ndevices){
 			object_post(&ob, "Could not find any connected Kinect device. Are you sure the power cord is plugged-in?");
-			capturing = 0;
-			return;
+			manager->release();
+			return 0;
 		}
 		
 		if (argc > 0 && atom_gettype(argv) == A_SYM) {
 			const char * serial = atom_getsym(argv)->s_name;
 			object_post(&ob, "opening device %s", serial);
-			if (freenect_open_device_by_camera_serial(f_ctx, &device, serial) < 0) {
+			if (freenect_open_device_by_camera_serial(ctx, &device, serial) < 0) {
 				object_error(&ob, "failed to open device %s", serial);
 				device = NULL;
 			}
+			reopen_arg = argv[0];
 		} else {
 			int devidx = 0;
 			if (argc > 0 && atom_gettype(argv) == A_LONG) devidx = atom_getlong(argv);
 			
 			object_post(&ob, "opening device %d", devidx);
-			if (freenect_open_device(f_ctx, &device, devidx) < 0) {
+			if (freenect_open_device(ctx, &device, devidx) < 0) {
 				object_error(&ob, "failed to open device %d", devidx);
 				device = NULL;
 			}
+			
+			// indices change as devices come & go, so the watchdog reopens it by serial
+			// (devices are listed in the same order as they are opened):
+			atom_setlong(&reopen_arg, devidx);
+			struct freenect_device_attributes* attribute_list;
+			int num_devices = freenect_list_device_attributes(ctx, &attribute_list);
+			if (num_devices >= 0) {
+				struct freenect_device_attributes* attribute = attribute_list;
+				for (int i=0; i<devidx && attribute; i++) attribute = attribute->next;
+				if (device && attribute) atom_setsym(&reopen_arg, gensym(attribute->camera_serial));
+				freenect_free_device_attributes(attribute_list);
+			}
 		}
 		
 		if (!device) {
 			// failed to create device:
-			capturing--;
-			return;
+			manager->release();
+			return 0;
 		}
 		
+		
+		// the processing thread reads the tables, so they're in place before it starts:
+		registration_data = freenect_copy_registration(device);
+		reg_offset = registration_data.reg_pad_info.start_lines;
+		reg_shift = registration_data.depth_to_rgb_shift;
+		reg_table = registration_data.registration_table;
+		
+		// size everything for the modes before any frame arrives:
+		if (!video_mode_apply() || !depth_mode_apply() || !process_start()) {
+			reg_table = NULL;
+			reg_shift = NULL;
+			freenect_destroy_registration(&registration_data);
+			freenect_close_device(device);
+			device = NULL;
+			manager->release();
+			return 0;
+		}
 	
 		freenect_set_user(device, this);
 		freenect_set_depth_callback(device, depth_callback);
 		freenect_set_video_callback(device, rgb_callback);
 		
-		freenect_set_video_buffer(device, rgb_back);
-		freenect_set_depth_buffer(device, depth_data);
-		
-		freenect_set_video_mode(device, freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_RGB));
-		freenect_set_depth_mode(device, freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_MM));
-		
 		freenect_set_led(device,LED_RED);
 		
 		freenect_start_depth(device);
 		freenect_start_video(device);
+
+		if (!manager->attach(this)) {
+			object_warn(&ob, "more than %d devices open; the accelerometer won't be read", MAX_DEVICES);
+		}
+		return 1;
 	}
 	
-	void close() {
+	// control thread, or the destructor once that has stopped:
+	void close_device() {
 		if(!device) return;
 		
+		// stop the event thread polling this device:
+		manager->detach(this);
+		accel_clear();
+		
 		freenect_set_led(device,LED_BLINK_GREEN);
 		freenect_close_device(device);
 		device = NULL;
+		process_stop();
 		
-		// mark one less device running:
-		capturing--;
+		// nothing can be using the tables now:
+		reg_table = NULL;
+		reg_shift = NULL;
+		freenect_destroy_registration(&registration_data);
+		
+		// the event thread stops with the last device:
+		manager->release();
+	}
+	
+	// read the tilt state into the accelerometer cache (event thread, outside the callbacks):
+	void poll_accel() {
+		double ax, ay, az;
+		vec3f raw, up;
+
+		if (!accel_due()) return;
+		if (freenect_update_tilt_state(device) < 0) return;
+		freenect_get_mks_accel(freenect_get_tilt_state(device), &ax, &ay, &az);
+		raw.x = ax;
+		raw.y = ay;
+		raw.z = az;
+		// accelerometer axes follow the depth camera's;
+		// flip z for the cloud's GL convention:
+		up.x = ax;
+		up.y = ay;
+		up.z = -az;
+		accel_store(raw, up);
+	}
+	
+	// the depth stream format implied by the registration & depth_format attributes:
+	freenect_depth_format depth_stream_format() {
+		if (registration == REGISTRATION_HARDWARE) return FREENECT_DEPTH_REGISTERED;
+		switch (depth_format) {
+			case DEPTH_FORMAT_RAW: return FREENECT_DEPTH_11BIT;
+			case DEPTH_FORMAT_PACKED: return FREENECT_DEPTH_11BIT_PACKED;
+			case DEPTH_FORMAT_PACKED10: return FREENECT_DEPTH_10BIT_PACKED;
+			default: return FREENECT_DEPTH_MM;
+		}
+	}
+	
+	freenect_video_format video_stream_format() {
+		switch (video_format) {
+			case VIDEO_FORMAT_BAYER: return FREENECT_VIDEO_BAYER;
+			case VIDEO_FORMAT_IR: return FREENECT_VIDEO_IR_8BIT;
+			case VIDEO_FORMAT_IR10: return FREENECT_VIDEO_IR_10BIT;
+			case VIDEO_FORMAT_IR10_PACKED: return FREENECT_VIDEO_IR_10BIT_PACKED;
+			default: return FREENECT_VIDEO_RGB;
+		}
+	}
+	
+	// grow each buffer to hold bytes; only while the stream filling them is stopped:
+	void frames_reserve(frame_buffers& f, long bytes) {
+		if (bytes <= f.size) return;
+		for (int i=0; i<3; i++) {
+			sysmem_freeptr(f.buf[i]);
+			f.buf[i] = sysmem_newptr(bytes);
+		}
+		f.size = bytes;
 	}
 	
-	void accel() {
-		t_atom a[3];
-		double x, y, z;
+	// set the video mode implied by the attributes, resizing whatever it fills.
+	// the video stream must be stopped & the processing thread not running:
+	int video_mode_apply() {
+		freenect_video_format format = video_stream_format();
+		freenect_frame_mode mode = freenect_find_video_mode((freenect_resolution)video_resolution, format);
+		if (!mode.is_valid) {
+			object_error(&ob, "video format %ld is not available at resolution %ld", video_format, video_resolution);
+			return 0;
+		}
+		frames_reserve(video_frames, mode.bytes);
+		if (mode.width != video_width || mode.height != video_height) {
+			ir_unpacked = (uint16_t *)sysmem_resizeptr(ir_unpacked, mode.width*mode.height * sizeof(uint16_t));
+		}
+		video_resize(mode.width, mode.height, video_format);
 		
+		freenect_set_video_buffer(device, video_frames.buf[video_frames.filling]);
+		if (freenect_set_video_mode(device, mode) < 0) {
+			object_error(&ob, "failed to set video mode");
+			return 0;
+		}
+		video_stream = format;
+		video_stream_resolution = video_resolution;
+		return 1;
+	}
+	
+	// likewise for the depth stream:
+	int depth_mode_apply() {
+		freenect_depth_format format = depth_stream_format();
+		freenect_frame_mode mode = freenect_find_depth_mode((freenect_resolution)depth_resolution, format);
+		if (!mode.is_valid) {
+			object_error(&ob, "depth format %ld is not available at resolution %ld", depth_format, depth_resolution);
+			return 0;
+		}
+		frames_reserve(depth_frames, mode.bytes);
+		if (mode.width != depth_width || mode.height != depth_height) {
+			depth_unpacked = (uint16_t *)sysmem_resizeptr(depth_unpacked, mode.width*mode.height * sizeof(uint16_t));
+		}
+		depth_resize(mode.width, mode.height);
 		
-		if (!device) return;
+		freenect_set_depth_buffer(device, depth_frames.buf[depth_frames.filling]);
+		if (freenect_set_depth_mode(device, mode) < 0) {
+			object_error(&ob, "failed to set depth mode");
+			return 0;
+		}
+		depth_stream = format;
+		depth_stream_resolution = depth_resolution;
+		return 1;
+	}
+	
+	// have the control thread restart streams whose attributes changed
+	// (there's no device before the control thread exists):
+	void streams_update() {
+		if (control_thread) control_post(COMMAND_UPDATE, 0, NULL, (method)&control_threadfunc);
+	}
+	
+	// control thread: restart the video stream if the attributes now imply a different mode;
+	// returns 0 if the mode couldn't be set, leaving the stream stopped:
+	int update_video_stream() {
+		if (!device || (video_stream_format() == video_stream && video_resolution == video_stream_resolution)) return 1;
 		
-		freenect_update_tilt_state(device);
-		freenect_raw_tilt_state * state = freenect_get_tilt_state(device);
+		freenect_stop_video(device);
+		// the matrices may change size, so no frame may be in processing meanwhile:
+		process_stop();
+		int ok = video_mode_apply();
+		if (!ok) video_stream_resolution = -1;
+		process_start();
+		if (ok) freenect_start_video(device);
+		return ok;
+	}
+	
+	void set_video_format(long format) {
+		if (format < VIDEO_FORMAT_RGB) format = VIDEO_FORMAT_RGB;
+		if (format > VIDEO_FORMAT_IR10_PACKED) format = VIDEO_FORMAT_IR10_PACKED;
+		video_format = format;
+		streams_update();
+	}
+	
+	void set_video_resolution(long res) {
+		if (res < RESOLUTION_LOW) res = RESOLUTION_LOW;
+		if (res > RESOLUTION_HIGH) res = RESOLUTION_HIGH;
+		if (!freenect_find_video_mode((freenect_resolution)res, video_stream_format()).is_valid) {
+			object_error(&ob, "video format %ld is not available at resolution %ld", video_format, res);
+			return;
+		}
+		video_resolution = res;
+		streams_update();
+	}
+	
+	// control thread: restart the depth stream if the attributes now imply a different mode:
+	int update_depth_stream() {
+		if (!device || (depth_stream_format() == depth_stream && depth_resolution == depth_stream_resolution)) return 1;
 		
-		freenect_get_mks_accel(state, &x, &y, &z);
-		atom_setfloat(a+0, x);
-		atom_setfloat(a+1, y);
-		atom_setfloat(a+2, z);
-		outlet_anything(outlet_msg, gensym("accel"), 3, a);
+		freenect_stop_depth(device);
+		process_stop();
+		int ok = depth_mode_apply();
+		if (!ok) depth_stream_resolution = -1;
+		process_start();
+		if (ok) freenect_start_depth(device);
+		return ok;
+	}
+	
+	// control thread: restart the streams whose modes changed, and report the outcome:
+	void update_streams() {
+		int ok = update_video_stream();
+		ok &= update_depth_stream();
+		if (!ok) {
+			set_device_state(DEVICE_ERROR);
+		} else if (device && device_state == DEVICE_ERROR) {
+			// both streams are running again:
+			watchdog_reset(1);
+			set_device_state(DEVICE_STREAMING);
+		}
+	}
+	
+	void set_depth_resolution(long res) {
+		if (res < RESOLUTION_LOW) res = RESOLUTION_LOW;
+		if (res > RESOLUTION_HIGH) res = RESOLUTION_HIGH;
+		// (libfreenect only streams depth at medium resolution)
+		if (!freenect_find_depth_mode((freenect_resolution)res, depth_stream_format()).is_valid) {
+			object_error(&ob, "depth format %ld is not available at resolution %ld", depth_format, res);
+			return;
+		}
+		depth_resolution = res;
+		streams_update();
+	}
+	
+	void set_registration(long mode) {
+		if (mode < REGISTRATION_SOFTWARE) mode = REGISTRATION_SOFTWARE;
+		if (mode > REGISTRATION_TABLE) mode = REGISTRATION_TABLE;
+		registration = mode;
+		if (registration == REGISTRATION_HARDWARE && depth_format != DEPTH_FORMAT_MM) {
+			object_warn(&ob, "hardware registration always uses mm depth");
+		}
+		streams_update();
+	}
+	
+	void set_depth_format(long format) {
+		if (format < DEPTH_FORMAT_MM) format = DEPTH_FORMAT_MM;
+		if (format > DEPTH_FORMAT_PACKED10) format = DEPTH_FORMAT_PACKED10;
+		depth_format = format;
+		streams_update();
 	}
 	
 	void led(int option) {
+		t_atom a[1];
+		atom_setlong(a, option);
+		control_post(COMMAND_LED, 1, a, (method)&control_threadfunc);
+	}
+	
+	// control thread:
+	void device_led(int option) {
 		if (!device) return;
 		
 //		LED_OFF              = 0, /**< Turn LED off */
@@ -166,81 +656,458 @@ public:
 		freenect_set_led(device, (freenect_led_options)option);
 	}
 	
-	void depth_process() {
-		// for each cell:
-		for (int i=0; i<DEPTH_HEIGHT*DEPTH_WIDTH; i++) {
-			// cache raw, unrectified depth in output:
-			// (casts uint16_t to uint32_t)
-			depth_back[i] = depth_data[i];
+	// processing thread: a depth frame in the given freenect_depth_format
+	void depth_process(const uint16_t * depth_data, int format) {
+		long wanted = products_wanted();
+		// a skipped product stays stale until a frame computes it:
+		products_stale |= (PRODUCT_DEPTH | PRODUCT_CLOUD | PRODUCT_COLOR) & ~wanted;
+		if (!(wanted & PRODUCT_DEPTH)) return;
+		
+		double t0 = profile_begin();
+		const int cells = depth_height*depth_width;
+		depth_raw = NULL;
+		if (format == FREENECT_DEPTH_11BIT) {
+			depth_raw = depth_data;
+		} else if (format == FREENECT_DEPTH_11BIT_PACKED) {
+			unpack11((const uint8_t *)depth_data, depth_unpacked, cells);
+			depth_raw = depth_unpacked;
+		} else if (format == FREENECT_DEPTH_10BIT_PACKED) {
+			unpack10((const uint8_t *)depth_data, depth_unpacked, cells);
+			// 10-bit disparity is the 11-bit disparity at half resolution:
+			for (int i=0; i<cells; i++) {
+				uint16_t v = depth_unpacked[i];
+				depth_unpacked[i] = v == 1023 ? DEPTH_RAW_INVALID : v << 1;
+			}
+			depth_raw = depth_unpacked;
 		}
+		
+		if (depth_raw) {
+			// disparity to mm for the depth output & the stages that work in mm;
+			// the cloud converts depth_raw itself:
+			depth_lut_update();
+			for (int i=0; i<cells; i++) {
+				depth_back[i] = depth_lut_mm[depth_raw[i] & (DEPTH_LUT_SIZE-1)];
+			}
+		} else {
+			// for each cell:
+			for (int i=0; i<cells; i++) {
+				// cache raw, unrectified depth in output:
+				// (casts uint16_t to uint32_t)
+				depth_back[i] = depth_data[i];
+			}
+		}
+		products_stale &= ~PRODUCT_DEPTH;
 		new_depth_data = 1;
+		profile_end(STAGE_DEPTH, t0);
 
+		t0 = profile_begin();
+		bg_process();
+		if (!(wanted & PRODUCT_CLOUD)) {
+			profile_end(STAGE_CLOUD, t0);
+			return;
+		}
 		cloud_process();
+		profile_end(STAGE_CLOUD, t0);
+		
+		t0 = profile_begin();
+		outlier_process();
+		profile_end(STAGE_FILTER, t0);
+		
+		t0 = profile_begin();
+		blob_process();
+		profile_end(STAGE_BLOBS, t0);
+		
+		t0 = profile_begin();
+		voxel_process();
+		profile_end(STAGE_FILTER, t0);
+		
+		products_stale &= ~PRODUCT_CLOUD;
+		floor_cloud_ready();
+		group_process();
+	}
+	
+	// processing thread: a video frame in the given freenect_video_format
+	void video_process(const void * frame, int format) {
+		double t0 = profile_begin();
+		const int video_cells = video_width*video_height;
+		bayer_lazy = NULL;
+		
+		if (format == FREENECT_VIDEO_IR_8BIT) {
+			sysmem_copyptr(frame, ir_back, video_cells);
+			video_name = ir_name;
+			profile_end(STAGE_VIDEO, t0);
+			new_rgb_data = 1;
+			return;
+		}
+		if (format == FREENECT_VIDEO_IR_10BIT || format == FREENECT_VIDEO_IR_10BIT_PACKED) {
+			const uint16_t * src = (const uint16_t *)frame;
+			if (format == FREENECT_VIDEO_IR_10BIT_PACKED) {
+				unpack10((const uint8_t *)frame, ir_unpacked, video_cells);
+				src = ir_unpacked;
+			}
+			for (int i=0; i<video_cells; i++) ir10_back[i] = src[i];
+			video_name = ir10_name;
+			profile_end(STAGE_VIDEO, t0);
+			new_rgb_data = 1;
+			return;
+		}
+		
+		video_name = rgb_name;
+		if (format == FREENECT_VIDEO_BAYER) {
+			// if the colored cloud replaces the RGB image and reads one pixel per point,
+			// only those pixels need demosaicing:
+			if (align_rgb_to_cloud && rgb_single_sample()) {
+				bayer_lazy = (const uint8_t *)frame;
+			} else {
+				demosaic((const uint8_t *)frame);
+			}
+		} else {
+			sysmem_copyptr(frame, rgb_back, video_cells * sizeof(vec3c));
+		}
+		profile_end(STAGE_VIDEO, t0);
+		
+		new_rgb_data = 1;
+	}
+	
+	// processing thread: color the new cloud from the video frame last processed
+	// (ideally its pair), then publish both together:
+	void cloud_color() {
+		// (depth_process leaves the cloud stale when nothing uses it)
+		if (products_stale & PRODUCT_CLOUD) return;
+		if (!(products_wanted() & PRODUCT_COLOR)) {
+			products_stale |= PRODUCT_COLOR;
+		} else if (video_processed < 0) {
+			// no video yet
+			products_stale |= PRODUCT_COLOR;
+		} else {
+			if (video_processed == FREENECT_VIDEO_IR_8BIT) {
+				cloud_ir_process(0);
+			} else if (video_processed == FREENECT_VIDEO_IR_10BIT || video_processed == FREENECT_VIDEO_IR_10BIT_PACKED) {
+				cloud_ir_process(1);
+			} else {
+				cloud_rgb_process();
+			}
+			products_stale &= ~PRODUCT_COLOR;
+			if (align_rgb_to_cloud) profile_add(STAGE_PAIR, fabs(depth_time - video_time));
+		}
+		new_cloud_data = 1;
+	}
+	
+	// USB thread: the frame being filled is complete;
+	// publish it as the latest and return the buffer to fill next.
+	void * frame_done(frame_buffers& f, int format) {
+		systhread_mutex_lock(frame_mutex);
+		int done = f.filling;
+		f.format[done] = format;
+		f.time[done] = frame_time = systimer_gettime();
+		f.filling = f.ready;
+		f.ready = done;
+		f.fresh = 1;
+		systhread_cond_signal(frame_cond);
+		systhread_mutex_unlock(frame_mutex);
+		return f.buf[f.filling];
+	}
+	
+	// processing thread, frame_mutex held: take the latest frame.
+	int frame_take(frame_buffers& f) {
+		int taken = f.ready;
+		f.ready = f.processing;
+		f.processing = taken;
+		f.fresh = 0;
+		return taken;
 	}
 	
 	static void rgb_callback(freenect_device *dev, void *pixels, uint32_t timestamp){
 		t_kinect *x = (t_kinect *)freenect_get_user(dev);
 		if(!x)return;
 		
-		x->cloud_rgb_process();
-		
-		x->new_rgb_data = 1;
+		freenect_set_video_buffer(dev, x->frame_done(x->video_frames, x->video_stream));
 	}
 	
 	static void depth_callback(freenect_device *dev, void *pixels, uint32_t timestamp){
 		t_kinect *x = (t_kinect *)freenect_get_user(dev);
 		if(!x)return;
 		
-		// consider moving this to another thread to avoid dropouts?
-		x->depth_process();
+		// processing happens on the processing thread, so USB packets aren't dropped meanwhile:
+		freenect_set_depth_buffer(dev, x->frame_done(x->depth_frames, x->depth_stream));
 	}
 	
-	static void log_cb(freenect_context *dev, freenect_loglevel level, const char *msg) {
-		post(msg);
+	static void *control_threadfunc(void *arg) {
+		t_kinect *x = (t_kinect *)arg;
+		device_command c;
+		
+		while (x->control_next(c)) {
+			switch (c.type) {
+				case COMMAND_OPEN:
+					if (x->device) {
+						object_post(&x->ob, "A device is already open.");
+						break;
+					}
+					x->set_device_state(DEVICE_OPENING);
+					if (x->open_device(c.argc, &c.arg)) {
+						x->watchdog_reset(1);
+						x->set_device_state(DEVICE_STREAMING);
+					} else {
+						x->watchdog_reset(0);
+						x->set_device_state(DEVICE_ERROR);
+					}
+					break;
+				case COMMAND_CLOSE:
+					x->watchdog_reset(0);
+					if (x->device) {
+						x->set_device_state(DEVICE_CLOSING);
+						x->close_device();
+					}
+					if (x->device_state != DEVICE_CLOSED) x->set_device_state(DEVICE_CLOSED);
+					break;
+				case COMMAND_UPDATE:
+					x->update_streams();
+					break;
+				case COMMAND_LED:
+					x->device_led(atom_getlong(&c.arg));
+					break;
+				case COMMAND_WATCHDOG:
+					// a device that stopped streaming (unplugged, or its transfers died)
+					// is closed, then reopened into the same buffers & matrices:
+					if (x->watchdog_lost()) {
+						x->close_device();
+					} else if (x->watchdog_reopen_due()) {
+						x->set_device_state(DEVICE_OPENING);
+						x->watchdog_reopened(x->open_device(1, &x->reopen_arg));
+					}
+					break;
+			}
+			x->control_done();
+		}
+		
+		systhread_exit(NULL);
+		return NULL;
+	}
+	
+	// (re)start the processing thread; frames published while it was stopped are dropped,
+	// but the buffer indices are kept, since a running stream may be filling one of them:
+	int process_start() {
+		depth_frames.fresh = video_frames.fresh = 0;
+		
+		processing = 1;
+		if (systhread_create((method)&process_threadfunc, this, 0, 0, 0, &process_thread)) {
+			object_error(&ob, "Failed to create processing thread.");
+			processing = 0;
+			process_thread = 0;
+			return 0;
+		}
+		return 1;
 	}
 	
-	static void *capture_threadfunc(void *arg) {
+	void process_stop() {
+		if (!process_thread) return;
+		systhread_mutex_lock(frame_mutex);
+		processing = 0;
+		systhread_cond_signal(frame_cond);
+		systhread_mutex_unlock(frame_mutex);
+		
+		unsigned int ret;
+		systhread_join(process_thread, &ret);
+		process_thread = 0;
+		bayer_lazy = NULL;
+		// (the video matrices may be resized before the next frame)
+		video_processed = -1;
+	}
+	
+	static void *process_threadfunc(void *arg) {
 		t_kinect *x = (t_kinect *)arg;
 		
-		// create the freenect context:
-		freenect_context *context;		
-		if(!f_ctx){
-			if (freenect_init(&context, NULL) < 0) {
-				error("freenect_init() failed");
-				goto out;
-			}
-		}
-		f_ctx = context;
-				
-		freenect_set_log_callback(f_ctx, log_cb);
-//		FREENECT_LOG_FATAL = 0,     /**< Log for crashing/non-recoverable errors */
-//		FREENECT_LOG_ERROR,         /**< Log for major errors */
-//		FREENECT_LOG_WARNING,       /**< Log for warning messages */
-//		FREENECT_LOG_NOTICE,        /**< Log for important messages */
-//		FREENECT_LOG_INFO,          /**< Log for normal messages */
-//		FREENECT_LOG_DEBUG,         /**< Log for useful development messages */
-//		FREENECT_LOG_SPEW,          /**< Log for slightly less useful messages */
-//		FREENECT_LOG_FLOOD,         /**< Log EVERYTHING. May slow performance. */
-		freenect_set_log_level(f_ctx, FREENECT_LOG_WARNING);
-		
-		
-		capturing = 1;
-		post("freenect starting processing");
-		while (capturing > 0) {
-			int err = freenect_process_events(f_ctx);
-			//int err = freenect_process_events_timeout(f_ctx);
-			if(err < 0){
-				error("Freenect could not process events.");
-				break;
+		systhread_mutex_lock(x->frame_mutex);
+		while (x->processing) {
+			char depth_fresh = x->depth_frames.fresh;
+			char video_fresh = x->video_frames.fresh;
+			if (!depth_fresh && !video_fresh) {
+				systhread_cond_wait(x->frame_cond, x->frame_mutex);
+				continue;
+			}
+			// when the cloud is colored (and used), a frame waits a little for its partner from
+			// the other stream (they usually arrive within a few ms of each other):
+			if (x->align_rgb_to_cloud && (x->products_wanted() & PRODUCT_COLOR)) {
+				if (depth_fresh != video_fresh) {
+					frame_buffers& f = depth_fresh ? x->depth_frames : x->video_frames;
+					long wait = (long)ceil(f.time[f.ready] + PAIR_TOLERANCE_MS - systimer_gettime());
+					if (wait > 0) {
+						systhread_cond_timedwait(x->frame_cond, x->frame_mutex, wait);
+						continue;
+					}
+				} else {
+					// both are new, but not necessarily a pair (e.g. after a slow frame):
+					// the older goes on its own, and the newer waits for its partner
+					double dt = x->depth_frames.time[x->depth_frames.ready] - x->video_frames.time[x->video_frames.ready];
+					if (dt > PAIR_TOLERANCE_MS) depth_fresh = 0;
+					else if (dt < -PAIR_TOLERANCE_MS) video_fresh = 0;
+				}
+			}
+			int depth = depth_fresh ? x->frame_take(x->depth_frames) : -1;
+			int video = video_fresh ? x->frame_take(x->video_frames) : -1;
+			systhread_mutex_unlock(x->frame_mutex);
+			
+			if (video >= 0 && (x->products_wanted() & PRODUCT_VIDEO)) {
+				x->video_process(x->video_frames.buf[video], x->video_frames.format[video]);
+				x->video_processed = x->video_frames.format[video];
+				x->video_time = x->video_frames.time[video];
+				x->products_stale &= ~PRODUCT_VIDEO;
+			} else if (video >= 0) {
+				// nothing uses it; nor can a later cloud be colored from the frame before:
+				x->video_processed = -1;
+				x->bayer_lazy = NULL;
+				x->products_stale |= PRODUCT_VIDEO;
 			}
-			systhread_sleep(0);
+			// a cloud is colored once, from its pair if there is one, else the latest video;
+			// a video frame on its own doesn't recolor the cloud of an earlier depth frame:
+			if (depth >= 0) {
+				x->depth_time = x->depth_frames.time[depth];
+				x->depth_process((const uint16_t *)x->depth_frames.buf[depth], x->depth_frames.format[depth]);
+				x->cloud_color();
+			}
+			
+			systhread_mutex_lock(x->frame_mutex);
 		}
-		post("freenect finished processing");
+		systhread_mutex_unlock(x->frame_mutex);
 		
-	out: 
-		freenect_shutdown(f_ctx);
-		f_ctx = NULL;
 		systhread_exit(NULL);
 		return NULL;
 	}
-};
\ No newline at end of file
+};
+
+// the event thread: processes USB events for every open device, and polls their accelerometers.
+void *freenect_manager::threadfunc(void *arg) {
+	freenect_manager *m = (freenect_manager *)arg;
+	
+	thread_affinity(m->affinity);
+	post("freenect starting processing");
+	systhread_mutex_lock(m->mutex);
+	m->started = 1;
+	systhread_cond_broadcast(m->changed);
+	systhread_mutex_unlock(m->mutex);
+	
+	int failing = 0;
+	while (m->running) {
+		// blocks until there are events, or the timeout, so there's no need to yield:
+		struct timeval timeout;
+		timeout.tv_sec = 0;
+		timeout.tv_usec = EVENT_TIMEOUT_MS * 1000;
+		int err = freenect_process_events_timeout(m->ctx, &timeout);
+		if(err < 0){
+			// (e.g. a device was unplugged) keep going, so the others, and the device
+			// once the watchdog reopens it, are still served:
+			if (!failing) error("Freenect could not process events.");
+			failing = 1;
+			systhread_sleep(EVENT_TIMEOUT_MS);
+		} else {
+			failing = 0;
+		}
+		
+		systhread_mutex_lock(m->mutex);
+		for (int i=0; i<MAX_DEVICES; i++) {
+			if (m->devices[i]) m->devices[i]->poll_accel();
+		}
+		systhread_mutex_unlock(m->mutex);
+	}
+	post("freenect finished processing");
+	
+	systhread_exit(NULL);
+	return NULL;
+}
+
+int device_registry::request(t_kinect * x) {
+	systhread_mutex_lock(mutex);
+	if (time && systimer_gettime() - time < DEVLIST_MAX_AGE) {
+		systhread_mutex_unlock(mutex);
+		return 1;
+	}
+	if (!x->devlist_waiting) {
+		x->devlist_next = waiting;
+		x->devlist_waiting = 1;
+		waiting = x;
+	}
+	if (!refreshing) {
+		// the previous refresh has finished:
+		if (thread) {
+			unsigned int ret;
+			systhread_join(thread, &ret);
+			thread = 0;
+		}
+		refreshing = 1;
+		if (systhread_create((method)&threadfunc, this, 0, 0, 0, &thread)) {
+			error("Failed to create device listing thread.");
+			refreshing = 0;
+			thread = 0;
+		}
+	}
+	systhread_mutex_unlock(mutex);
+	return 0;
+}
+
+void device_registry::forget(t_kinect * x) {
+	systhread_mutex_lock(mutex);
+	for (t_kinect ** p = &waiting; *p; p = &(*p)->devlist_next) {
+		if (*p == x) {
+			*p = x->devlist_next;
+			break;
+		}
+	}
+	x->devlist_waiting = 0;
+	if (--objects) {
+		systhread_mutex_unlock(mutex);
+		return;
+	}
+	// the last object: nobody is waiting, so a refresh in progress only has to finish
+	// (and a new object starts over with a new listing):
+	t_systhread t = thread;
+	thread = 0;
+	time = 0;
+	systhread_mutex_unlock(mutex);
+	if (t) {
+		unsigned int ret;
+		systhread_join(t, &ret);
+	}
+	systhread_mutex_free(mutex);
+	mutex = 0;
+}
+
+// the listing thread: enumerate with a context of its own, then answer whoever asked:
+void *device_registry::threadfunc(void *arg) {
+	device_registry *r = (device_registry *)arg;
+	entry devices[MAX_DEVICES];
+	int count = 0;
+	
+	freenect_context * ctx;
+	if (freenect_init(&ctx, NULL) < 0) {
+		error("freenect_init() failed");
+	} else {
+		freenect_set_log_level(ctx, FREENECT_LOG_WARNING);
+		struct freenect_device_attributes* attribute_list;
+		if (freenect_list_device_attributes(ctx, &attribute_list) >= 0) {
+			for (struct freenect_device_attributes* attribute = attribute_list; attribute && count < MAX_DEVICES; attribute = attribute->next) {
+				const char * serial = attribute->camera_serial ? attribute->camera_serial : "";
+				devices[count].serial = gensym(serial);
+				devices[count].model = (serial[0] && !serial[strspn(serial, "0")]) ? 1473 : 1414;
+				count++;
+			}
+			freenect_free_device_attributes(attribute_list);
+		}
+		freenect_shutdown(ctx);
+	}
+	
+	systhread_mutex_lock(r->mutex);
+	memcpy(r->devices, devices, sizeof(devices));
+	r->count = count;
+	r->time = systimer_gettime();
+	r->refreshing = 0;
+	while (r->waiting) {
+		t_kinect * x = r->waiting;
+		r->waiting = x->devlist_next;
+		x->devlist_waiting = 0;
+		qelem_set(x->devlist_qelem);
+	}
+	systhread_mutex_unlock(r->mutex);
+	
+	systhread_exit(NULL);
+	return NULL;
+}
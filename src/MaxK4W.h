@@ -34,31 +34,42 @@ public:
 		device = 0;
 		colorStreamHandle = 0;
 		capturing = 0;
+		capture_thread = 0;
 		
 		HRESULT result = NuiGetSensorCount(&device_count);
 		if (result != S_OK) object_error(&ob, "failed to get sensor count");
 	}
 
 	~t_kinect() {
-		close();
+		control_stop();
+		close_device();
 	}
 
+	// open and close are carried out by the control thread, which reports the state:
 	void open(t_symbol *s, long argc, t_atom * argv) {
+		control_post(COMMAND_OPEN, argc, argv, (method)&control_threadfunc);
+	}
+	
+	void close() {
+		control_post(COMMAND_CLOSE, 0, NULL, (method)&control_threadfunc);
+	}
+
+	// control thread; returns 0 on failure (the capture thread reports later ones):
+	int open_device(long argc, t_atom * argv) {
 		int index = 0;
 		if (argc > 0) index = atom_getlong(argv);
 		// TODO: support 'open serial'
-
-		if (device) {
-			object_warn(&ob, "device already opened");
-			return;
-		}
+		atom_setlong(&reopen_arg, index);
+		
+		// reap a capture thread that stopped by itself:
+		if (capture_thread) close_device();
 	
 		INuiSensor* dev;
 		HRESULT result = 0;
 		result = NuiCreateSensorByIndex(index, &dev);
 		if (result != S_OK) {
 			object_error(&ob, "failed to create sensor");
-			return;
+			return 0;
 		}
 		
 		result = dev->NuiStatus();
@@ -66,31 +77,36 @@ public:
 		case S_OK:
 			break;
 		case S_NUI_INITIALIZING:
-			object_post(&ob, "the device is connected, but still initializing"); return;
+			object_post(&ob, "the device is connected, but still initializing"); return 0;
 		case E_NUI_NOTCONNECTED:
-			object_error(&ob, "the device is not connected"); return;
+			object_error(&ob, "the device is not connected"); return 0;
 		case E_NUI_NOTGENUINE:
 			object_post(&ob, "the device is not a valid kinect"); break;
 		case E_NUI_NOTSUPPORTED:
 			object_post(&ob, "the device is not a supported model"); break;
 		case E_NUI_INSUFFICIENTBANDWIDTH:
-			object_error(&ob, "the device is connected to a hub without the necessary bandwidth requirements."); return;
+			object_error(&ob, "the device is connected to a hub without the necessary bandwidth requirements."); return 0;
 		case E_NUI_NOTPOWERED:
-			object_post(&ob, "the device is connected, but unpowered."); return;
+			object_post(&ob, "the device is connected, but unpowered."); return 0;
 		default:
-			object_post(&ob, "the device has some unspecified error"); return;
+			object_post(&ob, "the device has some unspecified error"); return 0;
 		}
 		
 		device = dev;
 		post("init device %p", device);
 
-		long priority = 0; // maybe increase?
+		// each device already has its own capture thread
+		// (set before it starts, so a close while it initializes isn't lost):
+		capturing = 1;
+		long priority = event_priority;
 		if (systhread_create((method)&capture_threadfunc, this, 0, priority, 0, &capture_thread)) {
 			object_error(&ob, "Failed to create capture thread.");
 			capturing = 0;
-			close();
-			return;
+			capture_thread = 0;
+			close_device();
+			return 0;
 		}
+		return 1;
 	}
 
 	void run() {
@@ -157,16 +173,17 @@ public:
 
 		//object_post(&ob, "aid %s cid %s", (const char*)(_bstr_t(device->NuiAudioArrayId(), false)), (const char*)(_bstr_t(device->NuiDeviceConnectionId(), false)));
 
-		capturing = 1;
 		post("starting processing");
 		while (capturing) {
 			pollDepth();
 			pollColor();
+			pollAccel();
 			//systhread_sleep(0);
 		}
 		post("finished processing");
 
 	done:
+		if (result != S_OK) set_device_state(DEVICE_ERROR);
 		shutdown();
 	}
 	
@@ -178,15 +195,18 @@ public:
 		}
 	}
 	
-	void close() {
-		if (capturing) {
-			capturing = 0;
+	// control thread, or the destructor once that has stopped:
+	void close_device() {
+		capturing = 0;
+		if (capture_thread) {
 			unsigned int ret;
 			long result = systhread_join(capture_thread, &ret);
+			capture_thread = 0;
 			post("thread closed");
 		} else {
 			shutdown();
 		}
+		accel_clear();
 	}
 
 	void pollDepth() {
@@ -211,6 +231,11 @@ public:
 			}
 			return;
 		}
+		// (the frame's own liTimeStamp is on the device's clock, which other devices don't share)
+		depth_time = frame_time = systimer_gettime();
+		// a skipped product stays stale until a frame computes it:
+		long wanted = products_wanted();
+		products_stale |= (PRODUCT_DEPTH | PRODUCT_CLOUD) & ~wanted;
 		INuiFrameTexture * imageTexture = NULL;
 		BOOL bNearMode = near_mode;
 		
@@ -222,6 +247,7 @@ public:
 			post("no data");
 			goto ReleaseFrame;
 		}
+		if (!(wanted & PRODUCT_DEPTH)) goto ReleaseFrame;
 		NUI_LOCKED_RECT LockedRect;
 	
 		// Lock the frame data so the Kinect knows not to modify it while we're reading it
@@ -234,7 +260,7 @@ public:
 			//const uint16_t * src = (const uint16_t *)LockedRect.pBits;
 			NUI_DEPTH_IMAGE_PIXEL * src = (NUI_DEPTH_IMAGE_PIXEL *)LockedRect.pBits;
 			uint32_t * dst = depth_back;
-			int cells = DEPTH_HEIGHT * DEPTH_WIDTH;
+			int cells = depth_height * depth_width;
 			do {
 				//*dst = (*src) & NUI_IMAGE_PLAYER_INDEX_MASK; // player ID
 				//*dst = (*src) >> NUI_IMAGE_PLAYER_INDEX_SHIFT; // depth in mm
@@ -243,13 +269,20 @@ public:
 				dst++;
 				src++;
 			} while (--cells);
+			products_stale &= ~PRODUCT_DEPTH;
 			new_depth_data = 1;
+
+			bg_process();
+		}
+		if (!(wanted & PRODUCT_CLOUD)) {
+			imageTexture->UnlockRect(0);
+			goto ReleaseFrame;
 		}
 
 
 		// for each cell:
-		for (int i=0, y=0; y<DEPTH_HEIGHT; y++) {
-			for (int x=0; x<DEPTH_WIDTH; x++, i++) {
+		for (int i=0, y=0; y<depth_height; y++) {
+			for (int x=0; x<depth_width; x++, i++) {
 				uint32_t d = depth_back[i];
 				uint32_t dmm = NuiDepthPixelToDepth(d);
 				Vector4 pos = NuiTransformDepthImageToSkeleton(x, y, d);
@@ -258,6 +291,10 @@ public:
 				p.x = pos.x * iw;
 				p.y = pos.y * iw;
 				p.z = pos.z * iw;
+				// background cells are treated like missing depth:
+				if (bg_subtract && bg_ready && !mask_back[i]) {
+					p.x = p.y = p.z = 0;
+				}
 				long cx, cy;	// coordinates in the rgb image
 				NuiImageGetColorPixelCoordinatesFromDepthPixelAtResolution(
                     NUI_IMAGE_RESOLUTION_640x480, // color frame resolution
@@ -271,6 +308,12 @@ public:
 		// We're done with the texture so unlock it
 		imageTexture->UnlockRect(0);
 
+		outlier_process();
+		blob_process();
+		voxel_process();
+		products_stale &= ~PRODUCT_CLOUD;
+		floor_cloud_ready();
+		group_process();
 		
 		//cloud_process();
 	ReleaseFrame:
@@ -302,7 +345,9 @@ public:
 			}
 			//close();
 			return;
-		} 
+		}
+		frame_time = systimer_gettime(); 
+		long wanted = products_wanted();
 
 		// got data; now turn it into jitter 
 		//post("frame %d", imageFrame.dwFrameNumber);
@@ -314,7 +359,7 @@ public:
 		imageTexture->LockRect(0, &LockedRect, NULL, 0); 
 
 		// Make sure we've received valid data
-		if (LockedRect.Pitch != 0) {
+		if (LockedRect.Pitch != 0 && (wanted & PRODUCT_VIDEO)) {
 			//post("pitch %d size %d", LockedRect.Pitch, LockedRect.size);
 			//static_cast<BYTE *>(LockedRect.pBits), LockedRect.size
 
@@ -323,7 +368,7 @@ public:
 			// convert to Jitter-friendly RGB layout:
 			const BGRA * src = (const BGRA *)LockedRect.pBits;
 			RGB * dst = (RGB *)rgb_back;
-			int cells = DEPTH_HEIGHT * DEPTH_WIDTH;
+			int cells = video_height * video_width;
 			do {
 				dst->r = src->r;
 				dst->g = src->g;
@@ -344,33 +389,125 @@ public:
 		// Release the frame
 		device->NuiImageStreamReleaseFrame(colorStreamHandle, &imageFrame);
 		
-		if (newframe) cloud_rgb_process();
+		if (!(wanted & PRODUCT_VIDEO)) {
+			products_stale |= PRODUCT_VIDEO | PRODUCT_COLOR;
+			return;
+		}
+		if (newframe) {
+			products_stale &= ~PRODUCT_VIDEO;
+			// only a cloud computed from the last depth frame, and only if its colors are used:
+			if ((wanted & PRODUCT_COLOR) && !(products_stale & PRODUCT_CLOUD)) {
+				cloud_rgb_process();
+				products_stale &= ~PRODUCT_COLOR;
+			} else {
+				products_stale |= PRODUCT_COLOR;
+			}
+		}
 		
 		new_rgb_data = 1;
 	}
 
+	void set_registration(long mode) {
+		if (mode != REGISTRATION_SOFTWARE) {
+			object_warn(&ob, "only software registration is available with the Kinect SDK");
+		}
+	}
+
+	void set_video_format(long format) {
+		if (format != VIDEO_FORMAT_RGB) {
+			object_warn(&ob, "only RGB video is available with the Kinect SDK");
+		}
+	}
+
+	void set_depth_format(long format) {
+		if (format != DEPTH_FORMAT_MM) {
+			object_warn(&ob, "raw depth is only available with libfreenect");
+		}
+	}
+
+	void set_depth_resolution(long res) {
+		if (res != RESOLUTION_MEDIUM) {
+			object_warn(&ob, "only medium resolution is available with the Kinect SDK");
+		}
+	}
+
+	void set_video_resolution(long res) {
+		if (res != RESOLUTION_MEDIUM) {
+			object_warn(&ob, "only medium resolution is available with the Kinect SDK");
+		}
+	}
+
 	void led(int option) {
 		object_warn(&ob, "LED not yet implemented for Windows");
 	}
 
-	void accel() {
-
-		if (!device) return;
-		
+	// read the accelerometer into the cache (capture thread):
+	void pollAccel() {
 		Vector4 pReading;
-		HRESULT result = device->NuiAccelerometerGetCurrentReading(&pReading);
-		
-		t_atom a[3];
-		atom_setfloat(a+0, pReading.x);
-		atom_setfloat(a+1, pReading.y);
-		atom_setfloat(a+2, pReading.z);
-		outlet_anything(outlet_msg, gensym("accel"), 3, a);
+
+		if (!accel_due()) return;
+		if (device->NuiAccelerometerGetCurrentReading(&pReading) != S_OK) return;
+		vec3f raw;
+		raw.x = pReading.x;
+		raw.y = pReading.y;
+		raw.z = pReading.z;
+		// the reading points down (in g), in skeleton space axes:
+		vec3f up;
+		up.x = -pReading.x;
+		up.y = -pReading.y;
+		up.z = -pReading.z;
+		accel_store(raw, up);
 	}
 
 	void getdevlist() {
 //		t_atom a[8];
 	}
 
+	static void *control_threadfunc(void *arg) {
+		t_kinect *x = (t_kinect *)arg;
+		device_command c;
+		
+		while (x->control_next(c)) {
+			switch (c.type) {
+				case COMMAND_OPEN:
+					if (x->device) {
+						object_warn(&x->ob, "device already opened");
+						break;
+					}
+					x->set_device_state(DEVICE_OPENING);
+					if (x->open_device(c.argc, &c.arg)) {
+						x->watchdog_reset(1);
+						x->set_device_state(DEVICE_STREAMING);
+					} else {
+						x->watchdog_reset(0);
+						x->set_device_state(DEVICE_ERROR);
+					}
+					break;
+				case COMMAND_CLOSE:
+					x->watchdog_reset(0);
+					if (x->device || x->capture_thread) {
+						x->set_device_state(DEVICE_CLOSING);
+						x->close_device();
+					}
+					if (x->device_state != DEVICE_CLOSED) x->set_device_state(DEVICE_CLOSED);
+					break;
+				case COMMAND_WATCHDOG:
+					// (the SDK has no serials, so the device is reopened by index)
+					if (x->watchdog_lost()) {
+						x->close_device();
+					} else if (x->watchdog_reopen_due()) {
+						x->set_device_state(DEVICE_OPENING);
+						x->watchdog_reopened(x->open_device(1, &x->reopen_arg));
+					}
+					break;
+			}
+			x->control_done();
+		}
+		
+		systhread_exit(NULL);
+		return NULL;
+	}
+
 	static void *capture_threadfunc(void *arg) {
 		t_kinect *x = (t_kinect *)arg;
 		x->run();
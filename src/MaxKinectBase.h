@@ -4,6 +4,8 @@
 	
 	
 	Q: is it better to have a separate freenect_context per device?
+	A: it can be, when the devices sit on separate USB host controllers; 
+	   see the private_context attribute.
 	
 */
 
@@ -12,6 +14,7 @@ extern "C" {
 	#include "ext_obex.h"
 	#include "ext_dictionary.h"
 	#include "ext_dictobj.h"
+	#include "jpatcher_api.h"
 	#include "ext_systhread.h"
 
 	#include "jit.common.h"
@@ -20,10 +23,144 @@ extern "C" {
 
 #include <new>
 #include "stdint.h"
+#include <math.h>
 
+// SSE2 is baseline on every x86_64 target we build for;
+// the scalar loops remain as the fallback and for the leftover cells.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define MAX_KINECT_SSE2 1
+	#include <emmintrin.h>
+#endif
+// SSSE3 (pshufb) is only assumed where the compiler says so:
+#if defined(__SSSE3__) || defined(__AVX__)
+	#define MAX_KINECT_SSSE3 1
+	#include <tmmintrin.h>
+#endif
+
+// the default (medium) frame size; the calibration attributes, rgb_map
+// and the factory registration tables are all expressed at this size:
 #define DEPTH_WIDTH 640
 #define DEPTH_HEIGHT 480
 
+// most blobs reported per frame:
+#define MAX_BLOBS 64
+// most enter/exit events held between bangs:
+#define MAX_TRACK_EVENTS 256
+// floor detection samples every FLOOR_STEP'th cell in each direction:
+#define FLOOR_STEP 4
+#define FLOOR_ITERATIONS 500
+// voxel hash table size (power of two, comfortably more than one entry per cell):
+#define VOXEL_TABLE_SIZE (1<<19)
+#define VOXEL_EMPTY (~(uint64_t)0)
+// how cloud points find their RGB color:
+#define REGISTRATION_SOFTWARE 0	// rgb_rotate/rgb_translate and the RGB distortion map
+#define REGISTRATION_HARDWARE 1	// depth registered to the RGB image by the driver
+#define REGISTRATION_TABLE 2	// the device's factory registration tables
+// fixed point scale of the registration table's x coordinates:
+#define REG_X_SCALE_BITS 8
+// depths (mm) covered by the registration shift table:
+#define REG_DEPTH_MAX 10000
+// raw depth formats:
+#define DEPTH_FORMAT_MM 0		// millimetres, converted by the driver
+#define DEPTH_FORMAT_RAW 1		// 11-bit disparity, converted by depth_lut
+#define DEPTH_FORMAT_PACKED 2	// ... packed by the device, unpacked by unpack11
+#define DEPTH_FORMAT_PACKED10 3	// 10-bit packed disparity, unpacked by unpack10
+#define DEPTH_LUT_SIZE 2048
+#define DEPTH_RAW_INVALID 2047
+#define DEPTH_MAX_MM 10000
+// processing stages timed by the profile attribute:
+#define STAGE_DEPTH 0
+#define STAGE_CLOUD 1
+#define STAGE_RGB 2
+#define STAGE_FILTER 3
+#define STAGE_BLOBS 4
+#define STAGE_VIDEO 5
+#define STAGE_PAIR 6	// (not a stage) time between a depth frame and the video frame coloring it
+#define STAGE_COUNT 7
+// video formats:
+#define VIDEO_FORMAT_RGB 0		// demosaiced by the driver
+#define VIDEO_FORMAT_BAYER 1	// raw Bayer, demosaiced by demosaic
+#define VIDEO_FORMAT_IR 2		// 8-bit infrared
+#define VIDEO_FORMAT_IR10 3		// 10-bit infrared
+#define VIDEO_FORMAT_IR10_PACKED 4	// ... packed by the device, unpacked by unpack10
+// the infrared image has a few more rows than depth:
+#define IR_HEIGHT 488
+// stream resolutions (the same values as freenect_resolution):
+#define RESOLUTION_LOW 0		// 320x240
+#define RESOLUTION_MEDIUM 1		// 640x480
+#define RESOLUTION_HIGH 2		// 1280x1024
+// clouds fused across devices by the group attribute:
+#define MAX_GROUPS 16
+#define MAX_GROUP_MEMBERS 8
+// frames buffered per member while group_sync matches them across devices:
+#define SYNC_FRAMES 4
+// device states, reported as "state <name>" from the message outlet:
+#define DEVICE_CLOSED 0
+#define DEVICE_OPENING 1
+#define DEVICE_STREAMING 2
+#define DEVICE_ERROR 3
+#define DEVICE_CLOSING 4
+// commands run in order by the device control thread:
+#define COMMAND_OPEN 0
+#define COMMAND_CLOSE 1
+#define COMMAND_UPDATE 2	// restart streams whose attributes changed
+#define COMMAND_LED 3
+#define COMMAND_WATCHDOG 4	// (not queued) the watchdog is due
+#define MAX_COMMANDS 8
+#define MAX_STATES 8		// state changes waiting to be reported
+// delays (ms) between attempts to reopen a lost device, doubling from min to max:
+#define REOPEN_DELAY_MIN 250
+#define REOPEN_DELAY_MAX 8000
+
+// outlets, left to right:
+#define OUTLET_CLOUD 0
+#define OUTLET_DEPTH 1
+#define OUTLET_RGB 2
+#define OUTLET_COUNT 3			// (the message outlet is always considered used)
+
+// the products of a frame, each computed only while something consumes it (see products_wanted):
+#define PRODUCT_DEPTH 1		// depth_back, in mm
+#define PRODUCT_CLOUD 2		// cloud_back & trans_cloud_back, filtered
+#define PRODUCT_VIDEO 4		// the rgb or infrared image
+#define PRODUCT_COLOR 8		// rgb_cloud_back
+#define PRODUCT_ALL 15
+
+class MaxKinectBase;
+
+// a named set of devices whose clouds are fused into one 4-plane float32 matrix
+// (x, y, z, device id), one row per member, each row written only by its member:
+struct cloud_group {
+	t_symbol *	name;
+	MaxKinectBase * members[MAX_GROUP_MEMBERS];
+	int			used[MAX_GROUP_MEMBERS];	// points in each row after its member's last frame
+	void *		mat;
+	void *		mat_wrapper;
+	t_atom		mat_name[1];
+	// members write their rows into back; a bang copies the rows to mat, then sends it
+	// holding out_mutex (recursive, in case the send reaches another member's bang):
+	float *		back;
+	int			width, rows;	// points per row, rows allocated
+	char		changed;		// rows written since the last copy
+	int			mat_used[MAX_GROUP_MEMBERS];	// points in each row of mat
+	t_systhread_mutex out_mutex;
+	
+	// with group_sync, each member's recent frames (compacted as in its row, allocated by group_ring_alloc)
+	// and their host times (ms, 0 = empty); only complete sets of them are written to the rows:
+	float *		ring[MAX_GROUP_MEMBERS][SYNC_FRAMES];
+	int			ring_used[MAX_GROUP_MEMBERS][SYNC_FRAMES];
+	double		ring_time[MAX_GROUP_MEMBERS][SYNC_FRAMES];
+	char		ring_sent[MAX_GROUP_MEMBERS][SYNC_FRAMES];	// was part of a set written
+	int			ring_next[MAX_GROUP_MEMBERS];
+	double		set_time;		// earliest frame time of the last set written
+	// since the last stats: sets written, their spread in time, frames never written:
+	long		sets, unmatched;
+	double		skew_total, skew_max;
+};
+
+// the groups, and their matrices while being written, are guarded by cloud_groups_mutex
+// (created with the first group):
+cloud_group * cloud_groups[MAX_GROUPS];
+t_systhread_mutex cloud_groups_mutex = 0;
 
 
 class MaxKinectBase {
@@ -34,6 +171,42 @@ public:
 	struct vec3f { float x, y, z; };
 	struct vec3c { uint8_t x, y, z; };
 	
+	// accumulated timing of one processing stage:
+	struct stage_stat {
+		double total, max;	// ms
+		long count;
+	};
+
+	// a connected region of the cloud:
+	struct blob {
+		int count;
+		vec3f centroid;
+		vec3f min, max;
+	};
+	
+	// a blob followed across frames:
+	struct track {
+		long id;
+		vec3f pos;
+		vec3f vel;		// per frame
+		int points;
+		int missed;		// frames since the track was last matched to a blob
+	};
+	
+	// one occupied cell of the voxel grid:
+	struct voxel {
+		uint64_t key;	// packed grid coordinates, or VOXEL_EMPTY
+		int first;		// cloud index of the first point in this voxel
+		int count;
+	};
+	
+	// a track appearing ("enter") or disappearing ("exit"):
+	struct track_event {
+		t_symbol * type;
+		long id;
+		vec3f pos;
+	};
+	
 	inline vec2f sample2f(vec2f * data, vec2f coord, int stridey) {
 		// warning: no bounds checking!
 		vec2f c00 = data[(int)(coord.x) + (int)(coord.y)*stridey];
@@ -56,6 +229,11 @@ public:
 		return result;
 	}
 	
+	// true if neighbouring depth n is valid but further than limit from d:
+	static inline int depth_jump(float d, uint32_t n, float limit) {
+		return n && fabsf(d - (float)n) > limit;
+	}
+
 	inline void sample3c(vec3c& result, vec3c * data, vec2f coord, int stridey) {
 		// warning: no bounds checking!
 		vec3c c00 = data[(int)(coord.x) + (int)(coord.y)*stridey];
@@ -86,13 +264,36 @@ public:
 	void *		outlet_rgb;
 	void *		outlet_depth;
 	void *		outlet_msg;
+	// patch cords from each matrix outlet, by OUTLET_*, maintained by patchline_update:
+	volatile long outlet_lines[OUTLET_COUNT];
+	// products skipped since they were last computed, by PRODUCT_*; their matrices are stale:
+	volatile long products_stale;
 	
+	// current frame sizes, set by depth_resize and video_resize:
+	int			depth_width, depth_height;	// depth, cloud and everything derived from them
+	int			video_width, video_height;	// the rgb or infrared matrix being filled
+	float		video_scale;	// video pixels per DEPTH_WIDTH-sized calibration pixel
+	int			video_shift;	// log2 of video_scale when that is a whole power of two, else -1
+
 	// rgb matrix for raw output:
 	void *		rgb_mat;
 	void *		rgb_mat_wrapper;
 	t_atom		rgb_name[1];
 	vec3c * 	rgb_back;
 	
+	// infrared matrices, sent from the rgb outlet instead when video_format is infrared:
+	void *		ir_mat;
+	void *		ir_mat_wrapper;
+	t_atom		ir_name[1];
+	uint8_t *	ir_back;
+	void *		ir10_mat;
+	void *		ir10_mat_wrapper;
+	t_atom		ir10_name[1];
+	uint32_t *	ir10_back;
+	
+	// whichever of rgb_name, ir_name or ir10_name the rgb outlet sends:
+	t_atom * volatile video_name;
+	
 	// depth matrix for raw output:
 	void *		depth_mat;
 	void *		depth_mat_wrapper;
@@ -116,7 +317,135 @@ public:
 	void *		rgb_cloud_mat_wrapper;
 	t_atom		rgb_cloud_name[1];
 	vec3c *		rgb_cloud_back;
-	
+
+	// foreground mask matrix for output (255 = foreground):
+	void *		mask_mat;
+	void *		mask_mat_wrapper;
+	t_atom		mask_name[1];
+	uint8_t *	mask_back;
+
+	// learned background model, per depth cell:
+	float *		bg_mean;	// mean depth (mm)
+	float *		bg_var;		// depth variance (mm^2); holds the sum of squares while learning
+	float *		bg_count;	// number of valid depth samples seen while learning
+
+	// blob label matrix for output (0 = none, otherwise blob index + 1):
+	void *		label_mat;
+	void *		label_mat_wrapper;
+	t_atom		label_name[1];
+	uint32_t *	label_back;
+
+	// connected components scratch:
+	uint32_t *	cc_labels;	// provisional, then compact label per cell
+	int *		cc_parent;	// union-find forest over provisional labels
+	blob *		cc_blobs;	// accumulators per compact label
+
+	// blobs of the latest frame, handed to the main thread under blob_mutex:
+	blob		blob_list[MAX_BLOBS];
+	blob		blob_out[MAX_BLOBS];
+	int			blob_out_count;
+	t_systhread_mutex blob_mutex;
+
+	// tracker state (capture thread only):
+	track		tracks[MAX_BLOBS];
+	int			track_count;
+	long		track_next_id;
+
+	// matched tracks & pending events, handed to the main thread under blob_mutex:
+	track		track_out[MAX_BLOBS];
+	int			track_out_count;
+	track_event	track_events[MAX_TRACK_EVENTS];
+	int			track_event_count;
+
+	// mean distance from each cloud point to its nearest neighbours (outlier removal):
+	void *		outlier_mat;
+	float *		outlier_dist;
+
+	// floor detection, run on its own thread by findfloor:
+	vec3f *		floor_points;	// subsampled snapshot of the cloud
+	int			floor_npoints;
+	vec3f		floor_prior;	// expected up direction, in cloud coordinates
+	float		floor_prior_cos;
+	vec3f		floor_normal;	// result: unit normal pointing up, and offset (n.p + d = 0)
+	float		floor_offset;
+	int			floor_inliers;
+	volatile char floor_busy;
+	t_systhread	floor_thread;
+	void *		floor_qelem;
+	// findfloor while the cloud is stale or being resized waits for the next one (1),
+	// which the processing thread reports (2):
+	volatile char floor_deferred;
+	int			floor_use_up;
+	vec3f		floor_up;
+
+	// latest accelerometer reading, polled by the capture thread, handed over under accel_mutex:
+	vec3f		accel_raw;		// as reported by the device
+	vec3f		accel_up;		// measured up direction, in cloud axes
+	vec3f		gravity_rotate[3];	// rotation taking accel_up to +y
+	int			accel_valid;
+	double		accel_time;		// when the capture thread last polled (ms)
+	t_systhread_mutex accel_mutex;
+
+	// per-stage timing, accumulated while profile is on and reported by stats:
+	stage_stat	stage_stats[STAGE_COUNT];
+	long		rgb_points;		// valid cloud points seen by cloud_rgb_process
+	long		rgb_colored;	// ... of which found a color
+	volatile char stats_reset;
+
+	// device control: open, close and stream changes are queued (main thread) to the control
+	// thread, so that USB round trips never stall the patch. device_mutex is held while the
+	// control thread works on the device; the main thread only tries it.
+	struct device_command {
+		int			type;	// COMMAND_OPEN, _CLOSE, _UPDATE or _LED
+		long		argc;
+		t_atom		arg;	// device index or serial, or LED option
+	};
+	device_command control_queue[MAX_COMMANDS];
+	int			control_first, control_count;
+	volatile char control_running;
+	t_systhread	control_thread;		// started by the first command
+	t_systhread_mutex control_mutex;	// guards the queue
+	t_systhread_cond control_cond;
+	t_systhread_mutex device_mutex;
+	volatile long device_state;		// DEVICE_CLOSED, _OPENING, _STREAMING, _ERROR or _CLOSING
+	// each change is queued, since a qelem only runs once for several sets:
+	long		state_queue[MAX_STATES];
+	int			state_first, state_count;
+	t_systhread_mutex state_mutex;	// guards the queue
+	void *		state_qelem;
+	// the watchdog, on the control thread: a streaming device without frames for
+	// watchdog ms is closed, and reopened with the same attributes:
+	volatile double frame_time;		// when the last frame arrived (ms), set by the driver layer
+	t_atom		reopen_arg;		// how to find the device again: its serial, or index
+	double		reopen_time;	// when to try reopening it (ms), or 0
+	double		reopen_delay;
+
+	// factory registration tables, owned by the driver layer (NULL if unavailable):
+	int32_t (*	reg_table)[2];	// per depth pixel: RGB x at infinity (fixed point), RGB row
+	int32_t *	reg_shift;		// per depth (mm): parallax shift of RGB x (fixed point)
+	int			reg_offset;		// rows of padding above the RGB image
+
+	// raw Bayer frame whose pixels cloud_rgb_process demosaics as it samples them, or NULL:
+	const uint8_t * bayer_lazy;
+
+	// raw disparity conversion (DEPTH_FORMAT_RAW), rebuilt when its parameters change:
+	const uint16_t * depth_raw;		// raw disparity of the current frame, or NULL
+	float		depth_lut[DEPTH_LUT_SIZE];		// disparity -> metres (0 = invalid)
+	uint32_t	depth_lut_mm[DEPTH_LUT_SIZE];	// disparity -> millimetres
+	float		depth_lut_base, depth_lut_offset, depth_lut_focal;	// parameters the tables were built with
+
+	// host time (ms) at which the depth frame being processed arrived, set by the driver layer:
+	double		depth_time;
+
+	// the fusion group this device writes its cloud into, if any (changed on the main thread):
+	cloud_group * volatile group_data;
+	int			group_slot;
+	float *		group_stage;	// this device's compacted cloud, before it is copied into the group
+
+	// voxel grid scratch (open addressing, linear probing):
+	voxel *		voxel_table;
+	int *		voxel_used;	// occupied slots of the current frame, so they can be emptied again
+
 	// attributes:
 	vec2f		depth_focal;
 	vec2f		depth_center;
@@ -126,7 +455,9 @@ public:
 	vec3f		rgb_rotate[3];
 	vec3f		trans_translate;
 	vec3f		trans_rotate[3];
-	float		depth_base, depth_offset;
+	float		depth_base, depth_offset;	// baseline (m) & disparity offset, for raw depth
+	long		depth_format;	// DEPTH_FORMAT_MM, _RAW, _PACKED or _PACKED10
+	long		video_format;	// VIDEO_FORMAT_RGB, _BAYER, _IR, _IR10 or _IR10_PACKED
 	int			unique;
 	int			device_count;
 	int			near_mode;
@@ -134,14 +465,55 @@ public:
 	int			use_rgb;
 	int			align_rgb_to_cloud;
 	int			transform_cloud;
-	
+	long		bg_subtract;
+	float		bg_threshold;	// minimum distance in front of the background (mm)
+	float		bg_sigma;		// minimum distance in front of the background (standard deviations)
+	float		bg_adapt;		// rate at which the background follows slow changes (0 = frozen)
+	long		blobs;
+	long		blob_labels;
+	long		blob_min_points;
+	long		blob_max;
+	float		blob_depth_step;	// largest depth difference (mm) between connected neighbours
+	long		tracking;
+	float		track_gate;		// furthest a track may move between frames (m)
+	long		track_timeout;	// frames a track survives without a matching blob
+	float		voxel_size;		// voxel grid leaf size (m), 0 = off
+	float		edge_threshold;	// largest depth jump to a neighbour, relative to depth (0 = off)
+	long		outlier_k;		// neighbours considered by outlier removal (0 = off)
+	long		outlier_window;	// pixel radius searched for those neighbours
+	float		outlier_alpha;	// points beyond mean + alpha * stddev are removed
+	float		floor_tolerance;	// largest distance (m) of a floor inlier from the plane
+	float		floor_angle;	// largest tilt (degrees) of the floor from the expected up direction
+	long		voxel_mode;		// 0: keep first point per voxel, 1: centroid
+	long		accel_interval;	// ms between accelerometer polls
+	long		gravity_align;	// level the transformed cloud using the accelerometer
+	long		registration;	// REGISTRATION_SOFTWARE, _HARDWARE or _TABLE
+	long		depth_resolution;	// RESOLUTION_LOW, _MEDIUM or _HIGH
+	long		video_resolution;
+	long		profile;		// time the processing stages
+	t_symbol *	group;			// name of the fusion group, or empty
+	float		group_sync;		// largest spread (ms) of the frames fused into a set (0 = off)
+	long		private_context;	// open the device with its own driver context & event thread
+	long		event_priority;	// priority of the event thread, when it starts
+	long		event_affinity;	// affinity tag of the event thread (0 = none), when it starts
+	long		watchdog;		// ms without frames before the device is reopened (0 = off)
+	long		lazy;			// only compute what connected outlets & enabled features use
+
 	vec2f *		depth_map_data;
 	vec2f *		rgb_map_data;
 	
 	volatile char new_rgb_data;
 	volatile char new_depth_data;
 	volatile char new_cloud_data;
-	
+	volatile char new_mask_data;
+	volatile char new_blob_data;
+	volatile char new_track_data;
+
+	// background learning state, set by learnbg (main thread), consumed by bg_process:
+	volatile int bg_learn_frames;
+	volatile char bg_learn_reset;
+	volatile char bg_ready;
+
 	MaxKinectBase() {
 		// set up attrs:
 		unique = 1;
@@ -155,10 +527,105 @@ public:
 		new_rgb_data = 0;
 		new_depth_data = 0;
 		new_cloud_data = 0;
-		
-		// can we accept a dict?
+		new_mask_data = 0;
+		new_blob_data = 0;
+		new_track_data = 0;
+
+		bg_subtract = 0;
+		bg_threshold = 50.f;
+		bg_sigma = 3.f;
+		bg_adapt = 0.f;
+		bg_learn_frames = 0;
+		bg_learn_reset = 0;
+		bg_ready = 0;
+
+		blobs = 0;
+		blob_labels = 0;
+		blob_min_points = 200;
+		blob_max = 16;
+		blob_depth_step = 50.f;
+		blob_out_count = 0;
+		systhread_mutex_new(&blob_mutex, 0);
+
+		tracking = 0;
+		track_gate = 0.5f;
+		track_timeout = 15;
+		track_count = 0;
+		track_next_id = 1;
+		track_out_count = 0;
+		track_event_count = 0;
+
+		voxel_size = 0.f;
+		voxel_mode = 0;
+		edge_threshold = 0.f;
+		outlier_k = 0;
+		outlier_window = 2;
+		outlier_alpha = 1.f;
+		floor_tolerance = 0.03f;
+		floor_angle = 20.f;
+		floor_npoints = 0;
+		floor_inliers = 0;
+		floor_busy = 0;
+		floor_thread = 0;
+		floor_qelem = qelem_new(this, (method)floor_qfn);
+		floor_deferred = 0;
+		floor_use_up = 0;
+		for (int i=0; i<OUTLET_COUNT; i++) outlet_lines[i] = 0;
+		products_stale = PRODUCT_ALL;
+		lazy = 1;
+		control_first = control_count = 0;
+		control_running = 0;
+		control_thread = 0;
+		systhread_mutex_new(&control_mutex, 0);
+		systhread_cond_new(&control_cond, 0);
+		systhread_mutex_new(&device_mutex, 0);
+		device_state = DEVICE_CLOSED;
+		state_first = state_count = 0;
+		systhread_mutex_new(&state_mutex, 0);
+		state_qelem = qelem_new(this, (method)state_qfn);
+		frame_time = 0;
+		atom_setlong(&reopen_arg, 0);
+		reopen_time = 0;
+		reopen_delay = REOPEN_DELAY_MIN;
+		accel_interval = 100;
+		accel_valid = 0;
+		accel_time = 0;
+		gravity_align = 0;
+		systhread_mutex_new(&accel_mutex, 0);
+		registration = REGISTRATION_SOFTWARE;
+		reg_table = NULL;
+		reg_shift = NULL;
+		reg_offset = 0;
+		profile = 0;
+		stats_reset = 1;
+		group = gensym("");
+		group_sync = 0.f;
+		depth_time = 0;
+		private_context = 0;
+		event_priority = 0;
+		event_affinity = 0;
+		watchdog = 2000;
+		group_data = NULL;
+		group_slot = -1;
+		group_stage = NULL;
+
+		depth_raw = NULL;
+		depth_format = DEPTH_FORMAT_MM;
+		bayer_lazy = NULL;
+		video_format = VIDEO_FORMAT_RGB;
+		depth_resolution = RESOLUTION_MEDIUM;
+		video_resolution = RESOLUTION_MEDIUM;
+		depth_width = DEPTH_WIDTH;
+		depth_height = DEPTH_HEIGHT;
+		video_width = DEPTH_WIDTH;
+		video_height = DEPTH_HEIGHT;
+		video_scale = 1.f;
+		video_shift = 0;
+		depth_lut_base = depth_lut_offset = depth_lut_focal = 0.f;
+
+		// RGBDemo's depth_base_and_offset, which the dictionary message can set:
 		depth_base = 0.085f;
-		depth_offset = 0.0011f;
+		depth_offset = 1090.f;
 		depth_center.x = 314.f;
 		depth_center.y = 241.f;
 		depth_focal.x = 597.f;
@@ -192,8 +659,8 @@ public:
 		info.planecount = 3;
 		info.type = gensym("char");
 		info.dimcount = 2;
-		info.dim[0] = DEPTH_WIDTH;
-		info.dim[1] = DEPTH_HEIGHT;
+		info.dim[0] = video_width;
+		info.dim[1] = video_height;
 		jit_object_method(rgb_mat, _jit_sym_setinfo_ex, &info);
 		jit_object_method(rgb_mat, _jit_sym_clear);
 		jit_object_method(rgb_mat, _jit_sym_getdata, &rgb_back);
@@ -208,8 +675,8 @@ public:
 		info.planecount = 1;
 		info.type = gensym("long");
 		info.dimcount = 2;
-		info.dim[0] = DEPTH_WIDTH;
-		info.dim[1] = DEPTH_HEIGHT;
+		info.dim[0] = depth_width;
+		info.dim[1] = depth_height;
 		jit_object_method(depth_mat, _jit_sym_setinfo_ex, &info);
 		jit_object_method(depth_mat, _jit_sym_clear);
 		jit_object_method(depth_mat, _jit_sym_getdata, &depth_back);
@@ -224,8 +691,8 @@ public:
 		info.planecount = 3;
 		info.type = gensym("float32");
 		info.dimcount = 2;
-		info.dim[0] = DEPTH_WIDTH;
-		info.dim[1] = DEPTH_HEIGHT;
+		info.dim[0] = depth_width;
+		info.dim[1] = depth_height;
 		jit_object_method(cloud_mat, _jit_sym_setinfo_ex, &info);
 		jit_object_method(cloud_mat, _jit_sym_clear);
 		jit_object_method(cloud_mat, _jit_sym_getdata, &cloud_back);
@@ -241,8 +708,8 @@ public:
 		info.planecount = 3;
 		info.type = gensym("float32");
 		info.dimcount = 2;
-		info.dim[0] = DEPTH_WIDTH;
-		info.dim[1] = DEPTH_HEIGHT;
+		info.dim[0] = depth_width;
+		info.dim[1] = depth_height;
 		jit_object_method(trans_cloud_mat, _jit_sym_setinfo_ex, &info);
 		jit_object_method(trans_cloud_mat, _jit_sym_clear);
 		jit_object_method(trans_cloud_mat, _jit_sym_getdata, &trans_cloud_back);
@@ -257,28 +724,219 @@ public:
 		info.planecount = 3;
 		info.type = gensym("char");
 		info.dimcount = 2;
-		info.dim[0] = DEPTH_WIDTH;
-		info.dim[1] = DEPTH_HEIGHT;
+		info.dim[0] = depth_width;
+		info.dim[1] = depth_height;
 		jit_object_method(rgb_cloud_mat, _jit_sym_setinfo_ex, &info);
 		jit_object_method(rgb_cloud_mat, _jit_sym_clear);
 		jit_object_method(rgb_cloud_mat, _jit_sym_getdata, &rgb_cloud_back);
 		// cache name:
 		atom_setsym(rgb_cloud_name, jit_attr_getsym(rgb_cloud_mat_wrapper, _jit_sym_name));
+
+		// both infrared matrices exist up front, so switching format at the same resolution never reallocates:
+		ir_mat_wrapper = jit_object_new(gensym("jit_matrix_wrapper"), jit_symbol_unique(), 0, NULL);
+		ir_mat = jit_object_method(ir_mat_wrapper, _jit_sym_getmatrix);
+		jit_matrix_info_default(&info);
+		info.flags |= JIT_MATRIX_DATA_PACK_TIGHT;
+		info.planecount = 1;
+		info.type = gensym("char");
+		info.dimcount = 2;
+		info.dim[0] = video_width;
+		info.dim[1] = IR_HEIGHT;
+		jit_object_method(ir_mat, _jit_sym_setinfo_ex, &info);
+		jit_object_method(ir_mat, _jit_sym_clear);
+		jit_object_method(ir_mat, _jit_sym_getdata, &ir_back);
+		atom_setsym(ir_name, jit_attr_getsym(ir_mat_wrapper, _jit_sym_name));
+
+		ir10_mat_wrapper = jit_object_new(gensym("jit_matrix_wrapper"), jit_symbol_unique(), 0, NULL);
+		ir10_mat = jit_object_method(ir10_mat_wrapper, _jit_sym_getmatrix);
+		info.type = gensym("long");
+		jit_object_method(ir10_mat, _jit_sym_setinfo_ex, &info);
+		jit_object_method(ir10_mat, _jit_sym_clear);
+		jit_object_method(ir10_mat, _jit_sym_getdata, &ir10_back);
+		atom_setsym(ir10_name, jit_attr_getsym(ir10_mat_wrapper, _jit_sym_name));
 		
-		// init undistortion maps with default data:
-		depth_map_data = (vec2f *)sysmem_newptr(DEPTH_WIDTH*DEPTH_HEIGHT * sizeof(vec2f));
+		video_name = rgb_name;
+
+		mask_mat_wrapper = jit_object_new(gensym("jit_matrix_wrapper"), jit_symbol_unique(), 0, NULL);
+		mask_mat = jit_object_method(mask_mat_wrapper, _jit_sym_getmatrix);
+		// create the internal data:
+		jit_matrix_info_default(&info);
+		info.flags |= JIT_MATRIX_DATA_PACK_TIGHT;
+		info.planecount = 1;
+		info.type = gensym("char");
+		info.dimcount = 2;
+		info.dim[0] = depth_width;
+		info.dim[1] = depth_height;
+		jit_object_method(mask_mat, _jit_sym_setinfo_ex, &info);
+		jit_object_method(mask_mat, _jit_sym_clear);
+		jit_object_method(mask_mat, _jit_sym_getdata, &mask_back);
+		// cache name:
+		atom_setsym(mask_name, jit_attr_getsym(mask_mat_wrapper, _jit_sym_name));
+
+		label_mat_wrapper = jit_object_new(gensym("jit_matrix_wrapper"), jit_symbol_unique(), 0, NULL);
+		label_mat = jit_object_method(label_mat_wrapper, _jit_sym_getmatrix);
+		// create the internal data:
+		jit_matrix_info_default(&info);
+		info.flags |= JIT_MATRIX_DATA_PACK_TIGHT;
+		info.planecount = 1;
+		info.type = gensym("long");
+		info.dimcount = 2;
+		info.dim[0] = depth_width;
+		info.dim[1] = depth_height;
+		jit_object_method(label_mat, _jit_sym_setinfo_ex, &info);
+		jit_object_method(label_mat, _jit_sym_clear);
+		jit_object_method(label_mat, _jit_sym_getdata, &label_back);
+		// cache name:
+		atom_setsym(label_name, jit_attr_getsym(label_mat_wrapper, _jit_sym_name));
+
+		jit_matrix_info_default(&info);
+		info.flags |= JIT_MATRIX_DATA_PACK_TIGHT;
+		info.planecount = 1;
+		info.type = _jit_sym_float32;
+		info.dimcount = 2;
+		info.dim[0] = depth_width;
+		info.dim[1] = depth_height;
+		outlier_mat = jit_object_new(_jit_sym_jit_matrix, &info);
+		jit_object_method(outlier_mat, _jit_sym_getdata, &outlier_dist);
+
+		voxel_table = (voxel *)sysmem_newptr(VOXEL_TABLE_SIZE * sizeof(voxel));
+		for (int i=0; i<VOXEL_TABLE_SIZE; i++) voxel_table[i].key = VOXEL_EMPTY;
+
+		// the rgb map is in calibration pixels, so it never changes size:
 		rgb_map_data = (vec2f *)sysmem_newptr(DEPTH_WIDTH*DEPTH_HEIGHT * sizeof(vec2f));
 		for (int i=0, y=0; y<DEPTH_HEIGHT; y++) {
 			for (int x=0; x<DEPTH_WIDTH; x++, i++) {
-				depth_map_data[i].x = x;
-				depth_map_data[i].y = y;
 				rgb_map_data[i].x = x;
 				rgb_map_data[i].y = y;
 			}
 		}
+
+		// everything else sized by depth:
+		depth_alloc();
+	}
+	
+	// allocate the per depth cell buffers for depth_width x depth_height:
+	void depth_alloc() {
+		int cells = depth_width*depth_height;
+		
+		// background model is empty until learnbg:
+		bg_mean = (float *)sysmem_newptrclear(cells * sizeof(float));
+		bg_var = (float *)sysmem_newptrclear(cells * sizeof(float));
+		bg_count = (float *)sysmem_newptrclear(cells * sizeof(float));
+		
+		// neighbours only connect when their depths are close, so every cell may get its own
+		// provisional label (label 0 is unused):
+		cc_labels = (uint32_t *)sysmem_newptrclear(cells * sizeof(uint32_t));
+		cc_parent = (int *)sysmem_newptrclear((cells + 1) * sizeof(int));
+		cc_blobs = (blob *)sysmem_newptrclear((cells + 1) * sizeof(blob));
+		
+		floor_points = (vec3f *)sysmem_newptr((depth_width/FLOOR_STEP)*(depth_height/FLOOR_STEP) * sizeof(vec3f));
+		voxel_used = (int *)sysmem_newptr(cells * sizeof(int));
+		
+		// init undistortion map with default data:
+		depth_map_data = (vec2f *)sysmem_newptr(cells * sizeof(vec2f));
+		for (int i=0, y=0; y<depth_height; y++) {
+			for (int x=0; x<depth_width; x++, i++) {
+				depth_map_data[i].x = x;
+				depth_map_data[i].y = y;
+			}
+		}
+	}
+	
+	void depth_free() {
+		sysmem_freeptr(depth_map_data);
+		sysmem_freeptr(bg_mean);
+		sysmem_freeptr(bg_var);
+		sysmem_freeptr(bg_count);
+		sysmem_freeptr(cc_labels);
+		sysmem_freeptr(cc_parent);
+		sysmem_freeptr(cc_blobs);
+		sysmem_freeptr(floor_points);
+		sysmem_freeptr(voxel_used);
+	}
+	
+	// give a matrix new dimensions, if they differ, and return its (possibly moved) data:
+	static void * matrix_resize(void * mat, int w, int h) {
+		t_jit_matrix_info info;
+		void * data;
+		jit_object_method(mat, _jit_sym_getinfo, &info);
+		if (info.dim[0] != w || info.dim[1] != h) {
+			info.dim[0] = w;
+			info.dim[1] = h;
+			jit_object_method(mat, _jit_sym_setinfo_ex, &info);
+			jit_object_method(mat, _jit_sym_clear);
+		}
+		jit_object_method(mat, _jit_sym_getdata, &data);
+		return data;
+	}
+	
+	// resize everything derived from depth; does nothing if the size is unchanged.
+	// the caller must make sure no frame is being processed meanwhile.
+	void depth_resize(int w, int h) {
+		if (w == depth_width && h == depth_height) return;
+		depth_width = w;
+		depth_height = h;
+		
+		depth_back = (uint32_t *)matrix_resize(depth_mat, w, h);
+		cloud_back = (vec3f *)matrix_resize(cloud_mat, w, h);
+		trans_cloud_back = (vec3f *)matrix_resize(trans_cloud_mat, w, h);
+		rgb_cloud_back = (vec3c *)matrix_resize(rgb_cloud_mat, w, h);
+		mask_back = (uint8_t *)matrix_resize(mask_mat, w, h);
+		label_back = (uint32_t *)matrix_resize(label_mat, w, h);
+		outlier_dist = (float *)matrix_resize(outlier_mat, w, h);
+		
+		// a loaded depth_map and the learned background no longer fit;
+		// a floor detection still running reads floor_points, so let it finish first:
+		floor_join();
+		depth_free();
+		depth_alloc();
+		bg_ready = 0;
+		bg_learn_frames = 0;
+		floor_npoints = 0;
+		
+		if (group_stage) {
+			systhread_mutex_lock(cloud_groups_mutex);
+			group_stage = (float *)sysmem_resizeptr(group_stage, w*h * 4 * sizeof(float));
+			if (group_data) group_resize(group_data);
+			systhread_mutex_unlock(cloud_groups_mutex);
+		}
+	}
+	
+	// resize the matrix that the given video format fills, and the scale at which
+	// cloud points sample it. the caller must make sure no frame is being processed meanwhile.
+	void video_resize(int w, int h, long format) {
+		video_width = w;
+		video_height = h;
+		video_scale = w / (float)DEPTH_WIDTH;
+		video_shift = -1;
+		for (int s=0; s<4; s++) {
+			if (w == DEPTH_WIDTH << s && h >= DEPTH_HEIGHT << s) video_shift = s;
+		}
+		switch (format) {
+			case VIDEO_FORMAT_IR:
+				ir_back = (uint8_t *)matrix_resize(ir_mat, w, h);
+				break;
+			case VIDEO_FORMAT_IR10:
+			case VIDEO_FORMAT_IR10_PACKED:
+				ir10_back = (uint32_t *)matrix_resize(ir10_mat, w, h);
+				break;
+			default:
+				rgb_back = (vec3c *)matrix_resize(rgb_mat, w, h);
+				break;
+		}
+	}
+	
+	// the video pixel under depth cell (x, y), assuming both cover the same field of view:
+	inline int video_index(int x, int y) {
+		if (video_width == depth_width) return x + y*video_width;
+		float s = video_width / (float)depth_width;
+		return (int)(x*s) + (int)(y*s)*video_width;
 	}
 	
 	~MaxKinectBase() {
+		// the floor thread reads the cloud buffers:
+		floor_join();
+		qelem_free(floor_qelem);
 		if (rgb_mat_wrapper) {
 			object_free(rgb_mat_wrapper);
 			rgb_mat_wrapper = NULL;
@@ -291,15 +949,50 @@ public:
 			object_free(cloud_mat_wrapper);
 			cloud_mat_wrapper = NULL;
 		}
-		sysmem_freeptr(depth_map_data);
+		if (mask_mat_wrapper) {
+			object_free(mask_mat_wrapper);
+			mask_mat_wrapper = NULL;
+		}
+		if (ir_mat_wrapper) {
+			object_free(ir_mat_wrapper);
+			ir_mat_wrapper = NULL;
+		}
+		if (ir10_mat_wrapper) {
+			object_free(ir10_mat_wrapper);
+			ir10_mat_wrapper = NULL;
+		}
 		sysmem_freeptr(rgb_map_data);
+		depth_free();
+		if (label_mat_wrapper) {
+			object_free(label_mat_wrapper);
+			label_mat_wrapper = NULL;
+		}
+		if (outlier_mat) {
+			jit_object_free(outlier_mat);
+			outlier_mat = NULL;
+		}
+		qelem_free(state_qelem);
+		systhread_mutex_free(state_mutex);
+		systhread_cond_free(control_cond);
+		systhread_mutex_free(control_mutex);
+		systhread_mutex_free(device_mutex);
+		sysmem_freeptr(voxel_table);
+		systhread_mutex_free(blob_mutex);
+		systhread_mutex_free(accel_mutex);
+		if (group_data) set_group(gensym(""));
+		if (group_stage) sysmem_freeptr(group_stage);
 	}
 	
 	void depth_map(t_symbol * name) {
-		`
+		map_load(name, depth_map_data, depth_width, depth_height);
 	}
 	
 	void rgb_map(t_symbol * name) {
+		map_load(name, rgb_map_data, DEPTH_WIDTH, DEPTH_HEIGHT);
+	}
+	
+	// load a 2-plane float32 matrix of pixel coordinates (w x h) into an undistortion map:
+	void map_load(t_symbol * name, vec2f * map_data, int w, int h) {
 		t_jit_matrix_info in_info;
 		long in_savelock;
 		char * in_bp;
@@ -334,17 +1027,17 @@ public:
 			goto unlock;
 		}
 		
-		if (in_info.dimcount != 2 || in_info.dim[0] != DEPTH_WIDTH || in_info.dim[1] != DEPTH_HEIGHT) {
+		if (in_info.dimcount != 2 || in_info.dim[0] != w || in_info.dim[1] != h) {
 			err = JIT_ERR_MISMATCH_DIM;
 			goto unlock;
 		}
 
-		// copy matrix data into depth map:
-		for (int i=0, y=0; y<DEPTH_HEIGHT; y++) {
+		// copy matrix data into the map:
+		for (int i=0, y=0; y<h; y++) {
 			// get row pointer:
 			char * ip = in_bp + y*in_info.dimstride[1];
 			
-			for (int x=0; x<DEPTH_WIDTH; x++, i++) {
+			for (int x=0; x<w; x++, i++) {
 				
 				// convert column pointer to vec2f:
 				const vec2f& v = *(vec2f *)(ip);
@@ -357,12 +1050,12 @@ public:
 				iy += 0.5;
 				
 				// clip at boundaries:
-				ix = ix < 0 ? 0 : ix >= DEPTH_WIDTH-1 ? DEPTH_WIDTH-1 : ix;
-				iy = iy < 0 ? 0 : iy >= DEPTH_HEIGHT-1 ? DEPTH_HEIGHT-1 : iy;
+				ix = ix < 0 ? 0 : ix >= w-1 ? w-1 : ix;
+				iy = iy < 0 ? 0 : iy >= h-1 ? h-1 : iy;
 				
 				// store:
-				rgb_map_data[i].x = ix;
-				rgb_map_data[i].y = iy;
+				map_data[i].x = ix;
+				map_data[i].y = iy;
 				
 				// move to next column:
 				ip += in_info.dimstride[0];
@@ -378,11 +1071,62 @@ public:
 		}
 	}
 	
+	// main thread: a patch cord to or from this object was connected or disconnected
+	// (outlet is the source outlet when this object is the source, else -1):
+	void patchline_update(long updatetype, long outlet) {
+		if (outlet < 0 || outlet >= OUTLET_COUNT) return;
+		if (updatetype == JPATCHLINE_CONNECT) {
+			outlet_lines[outlet]++;
+		} else if (updatetype == JPATCHLINE_DISCONNECT && outlet_lines[outlet] > 0) {
+			outlet_lines[outlet]--;
+		}
+	}
+	
+	// processing thread: the products a frame needs, i.e. those going out of a connected outlet
+	// and those an enabled feature is built on (PRODUCT_ALL unless lazy):
+	long products_wanted() {
+		if (!lazy) return PRODUCT_ALL;
+		long p = 0;
+		if (use_rgb && outlet_lines[OUTLET_RGB]) {
+			// the colored cloud is sampled from the video frame:
+			p |= align_rgb_to_cloud ? PRODUCT_COLOR | PRODUCT_VIDEO : PRODUCT_VIDEO;
+		}
+		// (live tracks take one more frame to retire, once tracking is turned off)
+		if (outlet_lines[OUTLET_CLOUD] || (p & PRODUCT_COLOR) || blobs || tracking || track_count || group_data || floor_deferred) {
+			p |= PRODUCT_CLOUD;
+		}
+		// the cloud is built from depth_back, and the background model learns & segments it:
+		if (outlet_lines[OUTLET_DEPTH] || (p & PRODUCT_CLOUD) || bg_learn_frames > 0 || bg_ready) {
+			p |= PRODUCT_DEPTH;
+		}
+		return p;
+	}
+	
 	void bang() {
+		// the control thread may be resizing the matrices; skip this frame:
+		if (systhread_mutex_trylock(device_mutex)) return;
+		
+		// foreground mask goes out the message outlet, as "mask jit_matrix <name>":
+		if (bg_ready && (new_mask_data || !unique)) {
+			t_atom a[2];
+			atom_setsym(a, _jit_sym_jit_matrix);
+			a[1] = mask_name[0];
+			outlet_anything(outlet_msg, gensym("mask"), 2, a);
+			new_mask_data = 0;
+		}
+		// (after tracking is turned off, the exits of its last tracks still go out)
+		if (new_track_data || (tracking && !unique)) {
+			track_output();
+			new_track_data = 0;
+		}
+		if (blobs && (new_blob_data || !unique)) {
+			blob_output();
+			new_blob_data = 0;
+		}
 		if (unique) {
 			if (use_rgb && new_rgb_data) {
 				if (!align_rgb_to_cloud) 
-					outlet_anything(outlet_rgb  , _jit_sym_jit_matrix, 1, rgb_name  );	
+					outlet_anything(outlet_rgb  , _jit_sym_jit_matrix, 1, video_name  );	
 				new_rgb_data = 0;			
 			}
 			if (new_depth_data) {
@@ -392,7 +1136,9 @@ public:
 			if (new_cloud_data) {
 				if (use_rgb && align_rgb_to_cloud)
 					outlet_anything(outlet_rgb  , _jit_sym_jit_matrix, 1, rgb_cloud_name  );
-				if (transform_cloud) {
+				if (group_data) {
+					group_output();
+				} else if (transform_cloud) {
 					outlet_anything(outlet_cloud, _jit_sym_jit_matrix, 1, trans_cloud_name);
 				} else {
 					outlet_anything(outlet_cloud, _jit_sym_jit_matrix, 1, cloud_name);
@@ -400,30 +1146,49 @@ public:
 				new_cloud_data = 0;
 			}
 		} else {
+			// stale products were skipped by the last frame, and go out again once one computes them:
+			long stale = products_stale;
 			if (use_rgb) {
 				if (align_rgb_to_cloud) {
-					outlet_anything(outlet_rgb  , _jit_sym_jit_matrix, 1, rgb_cloud_name  );
+					if (!(stale & PRODUCT_COLOR)) outlet_anything(outlet_rgb  , _jit_sym_jit_matrix, 1, rgb_cloud_name  );
 				} else {
-					outlet_anything(outlet_rgb  , _jit_sym_jit_matrix, 1, rgb_name  );
+					if (!(stale & PRODUCT_VIDEO)) outlet_anything(outlet_rgb  , _jit_sym_jit_matrix, 1, video_name  );
 				}
 			}
-			outlet_anything(outlet_depth, _jit_sym_jit_matrix, 1, depth_name);
-			if (transform_cloud) {
+			if (!(stale & PRODUCT_DEPTH)) outlet_anything(outlet_depth, _jit_sym_jit_matrix, 1, depth_name);
+			if (group_data) {
+				group_output();
+			} else if (stale & PRODUCT_CLOUD) {
+				// not computed
+			} else if (transform_cloud) {
 				outlet_anything(outlet_cloud, _jit_sym_jit_matrix, 1, trans_cloud_name);
 			} else {
 				outlet_anything(outlet_cloud, _jit_sym_jit_matrix, 1, cloud_name);
 			}
 		}
-
+		systhread_mutex_unlock(device_mutex);
 	}
 	
 	void cloud_process() {
-		float inv_depth_focal_x = 1.f/depth_focal.x;
-		float inv_depth_focal_y = 1.f/depth_focal.y;
-	
+		// registered depth is already undistorted & aligned to the RGB camera's image,
+		// so it is projected with the RGB camera's intrinsics instead:
+		int registered = registration == REGISTRATION_HARDWARE;
+		// the factory tables are indexed by raw depth pixel, so skip the distortion map for them too:
+		int raw_pixels = registered || reg_table_usable();
+		vec2f center = registered ? rgb_center : depth_center;
+		float inv_depth_focal_x = 1.f/(registered ? rgb_focal.x : depth_focal.x);
+		float inv_depth_focal_y = 1.f/(registered ? rgb_focal.y : depth_focal.y);
+		// the intrinsics are in calibration pixels:
+		float scale_x = DEPTH_WIDTH / (float)depth_width;
+		float scale_y = DEPTH_HEIGHT / (float)depth_height;
+		int foreground_only = bg_subtract && bg_ready;
+		float edge = edge_threshold;
+		vec3f rotate[3];
+		cloud_rotation(rotate);
+
 		// for each cell:
-		for (int i=0, y=0; y<DEPTH_HEIGHT; y++) {
-			for (int x=0; x<DEPTH_WIDTH; x++, i++) {
+		for (int i=0, y=0; y<depth_height; y++) {
+			for (int x=0; x<depth_width; x++, i++) {
 				
 				// remove the effects of lens distortion
 				// (lookup into distortion map)
@@ -433,9 +1198,33 @@ public:
 				// But it's not trivial to invert the lens distortion.
 				// Using a lookup map like this is also how OpenCV's undistort() works.
 				
-				vec2f di = depth_map_data[i];
-				uint16_t d = depth_back[(int)(di.x) + (int)(di.y)*DEPTH_WIDTH];
-				
+				vec2f di;
+				if (raw_pixels) {
+					di.x = x;
+					di.y = y;
+				} else {
+					di = depth_map_data[i];
+				}
+				int di_idx = (int)(di.x) + (int)(di.y)*depth_width;
+				uint16_t d = depth_back[di_idx];
+
+				// background cells are treated like missing depth:
+				if (foreground_only && !mask_back[di_idx]) d = 0;
+
+				// so are "flying pixels" smeared across depth discontinuities,
+				// detected as a jump to any valid neighbour beyond a fraction of the depth:
+				if (edge > 0.f && d) {
+					float limit = d * edge;
+					int ix = (int)(di.x);
+					int iy = (int)(di.y);
+					if ((ix > 0 && depth_jump(d, depth_back[di_idx-1], limit))
+					 || (ix < depth_width-1 && depth_jump(d, depth_back[di_idx+1], limit))
+					 || (iy > 0 && depth_jump(d, depth_back[di_idx-depth_width], limit))
+					 || (iy < depth_height-1 && depth_jump(d, depth_back[di_idx+depth_width], limit))) {
+						d = 0;
+					}
+				}
+
 				/*
 					Using depth interpolation only makes sense if we have pre-filtered
 					the depth data to remove null results (pixel too near, too far, or unknown)
@@ -446,9 +1235,9 @@ public:
 					float dxa = 1.-dxb;
 					float dya = 1.-dyb;
 					uint16_t d00 = d;
-					uint16_t d10 = depth_back[(int)(di.x + 1) + (int)(di.y)*DEPTH_WIDTH];
-					uint16_t d01 = depth_back[(int)(di.x) + (int)(di.y+1)*DEPTH_WIDTH];
-					uint16_t d11 = depth_back[(int)(di.x + 1) + (int)(di.y+1)*DEPTH_WIDTH];
+					uint16_t d10 = depth_back[(int)(di.x + 1) + (int)(di.y)*depth_width];
+					uint16_t d01 = depth_back[(int)(di.x) + (int)(di.y+1)*depth_width];
+					uint16_t d11 = depth_back[(int)(di.x + 1) + (int)(di.y+1)*depth_width];
 					d = (uint16_t)(
 						  d00 * dxa * dya
 						+ d10 * dxb * dya
@@ -460,11 +1249,12 @@ public:
 				
 //				if (d < 2047) {
 					// convert pixel coordinate to NDC depth plane intersection
-					float uv_x = (x - depth_center.x) * inv_depth_focal_x;
-					float uv_y = (y - depth_center.y) * inv_depth_focal_y;
+					float uv_x = (x*scale_x - center.x) * inv_depth_focal_x;
+					float uv_y = (y*scale_y - center.y) * inv_depth_focal_y;
 					
 					// convert to meters
-					float z = d * 0.001f;
+					// (raw disparity goes straight through the LUT, without rounding to mm)
+					float z = (d && depth_raw) ? depth_lut[depth_raw[di_idx]] : d * 0.001f;
 
 					// and scale according to depth (projection)
 					uv_x = uv_x * z;
@@ -482,15 +1272,15 @@ public:
 						float z1 = cloud_back[i].z;
 						
 						// rotate:
-						float x2 = trans_rotate[0].x * x1
-								 + trans_rotate[0].y * y1
-								 + trans_rotate[0].z * z1;
-						float y2 = trans_rotate[1].x * x1
-								 + trans_rotate[1].y * y1
-								 + trans_rotate[1].z * z1;
-						float z2 = trans_rotate[2].x * x1
-								 + trans_rotate[2].y * y1
-								 + trans_rotate[2].z * z1;
+						float x2 = rotate[0].x * x1
+								 + rotate[0].y * y1
+								 + rotate[0].z * z1;
+						float y2 = rotate[1].x * x1
+								 + rotate[1].y * y1
+								 + rotate[1].z * z1;
+						float z2 = rotate[2].x * x1
+								 + rotate[2].y * y1
+								 + rotate[2].z * z1;
 						
 						x2 += trans_translate.x;
 						y2 += trans_translate.y;
@@ -509,18 +1299,125 @@ public:
 //				}
 			}
 		}
-		
-		new_cloud_data = 1;
+		// (new_cloud_data is up to the driver layer, once the cloud is colored)
 	}
 	
+	// (re)build the disparity tables if depth_base, depth_offset or depth_focal changed,
+	// using RGBDemo's model z = base * focal / ((offset - raw) / 8):
+	void depth_lut_update() {
+		if (depth_lut_base == depth_base && depth_lut_offset == depth_offset && depth_lut_focal == depth_focal.x) return;
+		depth_lut_base = depth_base;
+		depth_lut_offset = depth_offset;
+		depth_lut_focal = depth_focal.x;
+		
+		float bf = 8.f * depth_base * depth_focal.x;
+		for (int raw=0; raw<DEPTH_LUT_SIZE; raw++) {
+			float disparity = depth_offset - raw;
+			float z = 0.f;
+			if (raw != DEPTH_RAW_INVALID && disparity > 0.f) {
+				z = bf / disparity;
+				if (z * 1000.f >= DEPTH_MAX_MM) z = 0.f;
+			}
+			depth_lut[raw] = z;
+			depth_lut_mm[raw] = (uint32_t)(z * 1000.f + 0.5f);
+		}
+	}
+
+	// unpack n big-endian bit-packed values of the given width (as sent by the device):
+	static void unpack_bits(const uint8_t * src, uint16_t * dst, int n, int bits) {
+		uint32_t buffer = 0, mask = (1 << bits) - 1;
+		int have = 0;
+		while (n-- > 0) {
+			while (have < bits) {
+				buffer = (buffer << 8) | *src++;
+				have += 8;
+			}
+			have -= bits;
+			*dst++ = (buffer >> have) & mask;
+		}
+	}
+
+	// unpack n 11-bit packed values, 8 values (11 bytes) at a time:
+	// each lane gathers the big-endian 16 bits its value starts in, plus the following byte,
+	// and the per-lane bit offsets are applied by multiplying with powers of two.
+	static void unpack11(const uint8_t * src, uint16_t * dst, int n) {
+		int i = 0;
+	#ifdef MAX_KINECT_SSSE3
+		const uint8_t * end = src + (n*11)/8;
+		const __m128i hi_shuf = _mm_setr_epi8(1,0, 2,1, 3,2, 5,4, 6,5, 7,6, 9,8, 10,9);
+		const __m128i lo_shuf = _mm_setr_epi8(2,-1, 3,-1, 4,-1, 6,-1, 7,-1, 8,-1, 10,-1, 11,-1);
+		// bit offsets within the first byte are 0,3,6,1,4,7,2,5:
+		const __m128i hi_mul = _mm_setr_epi16(1<<0, 1<<3, 1<<6, 1<<1, 1<<4, 1<<7, 1<<2, 1<<5);
+		const __m128i lo_mul = _mm_setr_epi16(1<<3, 1<<6, 1<<9, 1<<4, 1<<7, 1<<10, 1<<5, 1<<8);
+		// loads are 16 bytes wide, so leave the last few groups to the scalar loop:
+		for (; i+8<=n && src+16<=end; i+=8, src+=11) {
+			__m128i b = _mm_loadu_si128((const __m128i *)src);
+			// (hi << offset) keeps the value's leading bits at the top, >> 5 puts them in place;
+			// values that run into the third byte take its leading bits via (lo << (offset+3)) >> 16:
+			__m128i hi = _mm_mullo_epi16(_mm_shuffle_epi8(b, hi_shuf), hi_mul);
+			__m128i lo = _mm_mulhi_epu16(_mm_shuffle_epi8(b, lo_shuf), lo_mul);
+			_mm_storeu_si128((__m128i *)(dst+i), _mm_or_si128(_mm_srli_epi16(hi, 5), lo));
+		}
+	#endif
+		unpack_bits(src, dst+i, n-i, 11);
+	}
+
+	// unpack n 10-bit packed values, 8 values (10 bytes) at a time;
+	// a 10-bit value never spans more than the 16 bits it starts in:
+	static void unpack10(const uint8_t * src, uint16_t * dst, int n) {
+		int i = 0;
+	#ifdef MAX_KINECT_SSSE3
+		const uint8_t * end = src + (n*10)/8;
+		const __m128i hi_shuf = _mm_setr_epi8(1,0, 2,1, 3,2, 4,3, 6,5, 7,6, 8,7, 9,8);
+		const __m128i hi_mul = _mm_setr_epi16(1<<0, 1<<2, 1<<4, 1<<6, 1<<0, 1<<2, 1<<4, 1<<6);
+		for (; i+8<=n && src+16<=end; i+=8, src+=10) {
+			__m128i b = _mm_loadu_si128((const __m128i *)src);
+			__m128i hi = _mm_mullo_epi16(_mm_shuffle_epi8(b, hi_shuf), hi_mul);
+			_mm_storeu_si128((__m128i *)(dst+i), _mm_srli_epi16(hi, 6));
+		}
+	#endif
+		unpack_bits(src, dst+i, n-i, 10);
+	}
+
 	// find a corresponding RGB color for each cloud point:
-	// TODO: reduce to valid cloud points only?
 	void cloud_rgb_process() {
 		if (!align_rgb_to_cloud) return;
+		double t0 = profile_begin();
+		long points = 0, colored = 0;
 	
+		if (registration == REGISTRATION_HARDWARE) {
+			// depth & RGB pixels already correspond:
+			for (int i=0, y=0; y<depth_height; y++) {
+				for (int x=0; x<depth_width; x++, i++) {
+					rgb_cloud_back[i] = rgb_pixel(video_index(x, y));
+					if (cloud_back[i].z != 0.f) points++;
+				}
+			}
+			rgb_points = points;
+			rgb_colored = points;
+			profile_end(STAGE_RGB, t0);
+			return;
+		}
+		
+		if (reg_table_usable()) {
+			reg_table_process();
+			profile_end(STAGE_RGB, t0);
+			return;
+		}
+
 		// for each cell:
-		for (int i=0, y=0; y<DEPTH_HEIGHT; y++) {
-			for (int x=0; x<DEPTH_WIDTH; x++, i++) {
+		for (int i=0, y=0; y<depth_height; y++) {
+			for (int x=0; x<depth_width; x++, i++) {
+				// points without depth have no color
+				// (and would project to NaN):
+				if (cloud_back[i].z == 0.f) {
+					rgb_cloud_back[i].x = 0;
+					rgb_cloud_back[i].y = 0;
+					rgb_cloud_back[i].z = 0;
+					continue;
+				}
+				points++;
+				
 				vec3f uv;
 				// flip back from OpenGL:
 				// move the point into the RGB camera's coordinate frame:
@@ -546,7 +1443,7 @@ public:
 								
 				// use this to index our pre-calculated RGB distortion map
 				// the map is in the [-0.625, 0.625] range, but we want a coordinate in the appropriate range:
-				// convert to [0..1] range using 0.5+ndc*0.8; then scale to pixel size:
+				// convert to [0..1] range using 0.5+ndc*0.8; then scale to (calibration) pixel size:
 				vec2f t;
 				t.x = (0.5f + x1*0.8f) * (DEPTH_WIDTH);
 				t.y = (0.5f + y1*0.8f) * (DEPTH_HEIGHT);
@@ -574,52 +1471,1820 @@ public:
 					
 					} else {
 					
-						// use it to sample the RGB view:
-						sample3c(rgb_cloud_back[i], rgb_back, t, DEPTH_WIDTH);
+						// use it to sample the RGB view, at its own resolution:
+						t.x *= video_scale;
+						t.y *= video_scale;
+						sample3c(rgb_cloud_back[i], rgb_back, t, video_width);
+						colored++;
 					}
 				}
 			}
 		}
+		rgb_points = points;
+		rgb_colored = colored;
+		profile_end(STAGE_RGB, t0);
+	}
+
+	// the factory tables cover one calibration-sized depth frame, so they only apply at that size:
+	int reg_table_usable() {
+		return registration == REGISTRATION_TABLE && reg_table
+			&& depth_width == DEPTH_WIDTH && depth_height == DEPTH_HEIGHT;
 	}
 	
-	void dictionary(t_symbol *s, long argc, t_atom *argv) {
-		
-		t_dictionary	*d = dictobj_findregistered_retain(s);
-		long			numkeys = 0;
-		t_symbol		**keys = NULL;
-		int				i;
-//		int				size;
+	// the video pixel at calibration pixel (x, y):
+	inline int calib_to_video(int x, int y) {
+		if (video_shift >= 0) return (x << video_shift) + (y << video_shift)*video_width;
+		return (int)(x*video_scale) + (int)(y*video_scale)*video_width;
+	}
 
-		if (!d) {
-			object_error(&ob, "unable to reference dictionary named %s", s);
+	// color the cloud using the factory registration tables, in integer arithmetic only:
+	// a depth pixel's RGB x is its table x plus a shift that depends on depth (parallax),
+	// its RGB row comes straight from the table.
+	void reg_table_process() {
+		const int n = depth_width*depth_height;
+		long points = 0, colored = 0;
+		int i = 0;
+		
+	#ifdef MAX_KINECT_SSE2
+		// compute 4 RGB indices at a time; the table & RGB reads are gathers, so stay scalar.
+		// the video image is a power of two larger than the tables (or the scalar loop does it all):
+		const __m128i width = _mm_set1_epi32(DEPTH_WIDTH);
+		const __m128i height = _mm_set1_epi32(DEPTH_HEIGHT);
+		const __m128i stride = _mm_set1_epi32(video_width);
+		const __m128i shift = _mm_cvtsi32_si128(video_shift);
+		const __m128i offset = _mm_set1_epi32(reg_offset);
+		const __m128i none = _mm_set1_epi32(-1);
+		int32_t idx[4];
+		for (; video_shift >= 0 && i+4<=n; i+=4) {
+			int s[4];
+			for (int k=0; k<4; k++) {
+				uint32_t d = depth_back[i+k];
+				s[k] = reg_shift[d < REG_DEPTH_MAX ? d : REG_DEPTH_MAX-1];
+			}
+			// de-interleave the (x, y) pairs of 4 pixels:
+			__m128 t01 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *)reg_table[i]));
+			__m128 t23 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *)reg_table[i+2]));
+			__m128i tx = _mm_castps_si128(_mm_shuffle_ps(t01, t23, _MM_SHUFFLE(2, 0, 2, 0)));
+			__m128i ty = _mm_castps_si128(_mm_shuffle_ps(t01, t23, _MM_SHUFFLE(3, 1, 3, 1)));
+			
+			__m128i nx = _mm_srai_epi32(_mm_add_epi32(tx, _mm_set_epi32(s[3], s[2], s[1], s[0])), REG_X_SCALE_BITS);
+			__m128i ny = _mm_sub_epi32(ty, offset);
+			__m128i inside = _mm_and_si128(
+				_mm_and_si128(_mm_cmpgt_epi32(nx, none), _mm_cmplt_epi32(nx, width)),
+				_mm_and_si128(_mm_cmpgt_epi32(ny, none), _mm_cmplt_epi32(ny, height)));
+			// (ny << shift) * stride: both fit in 16 bits wherever inside is set
+			__m128i rgb = _mm_add_epi32(_mm_madd_epi16(_mm_sll_epi32(ny, shift), stride), _mm_sll_epi32(nx, shift));
+			rgb = _mm_or_si128(_mm_and_si128(inside, rgb), _mm_andnot_si128(inside, none));
+			_mm_storeu_si128((__m128i *)idx, rgb);
+			
+			for (int k=0; k<4; k++) {
+				reg_color(i+k, idx[k], points, colored);
+			}
+		}
+	#endif
+		for (; i<n; i++) {
+			uint32_t d = depth_back[i];
+			int nx = (reg_table[i][0] + reg_shift[d < REG_DEPTH_MAX ? d : REG_DEPTH_MAX-1]) >> REG_X_SCALE_BITS;
+			int ny = reg_table[i][1] - reg_offset;
+			int rgb = (nx >= 0 && nx < DEPTH_WIDTH && ny >= 0 && ny < DEPTH_HEIGHT) ? calib_to_video(nx, ny) : -1;
+			reg_color(i, rgb, points, colored);
+		}
+		rgb_points = points;
+		rgb_colored = colored;
+	}
+	
+	// copy the color at video index rgb (-1 if none) to cloud point i:
+	inline void reg_color(int i, int rgb, long& points, long& colored) {
+		if (cloud_back[i].z == 0.f) {
+			rgb_cloud_back[i].x = rgb_cloud_back[i].y = rgb_cloud_back[i].z = 0;
 			return;
 		}
+		points++;
+		if (rgb < 0) {
+			rgb_cloud_back[i].x = rgb_cloud_back[i].y = rgb_cloud_back[i].z = 0;
+			return;
+		}
+		rgb_cloud_back[i] = rgb_pixel(rgb);
+		colored++;
+	}
 
+	// color the cloud with the infrared image, which is seen by the depth camera itself,
+	// so each point takes the pixel at its own depth cell:
+	void cloud_ir_process(int ten_bit) {
+		if (!align_rgb_to_cloud) return;
+		for (int i=0, y=0; y<depth_height; y++) {
+			for (int x=0; x<depth_width; x++, i++) {
+				uint8_t v = 0;
+				if (cloud_back[i].z != 0.f) {
+					int j = video_index(x, y);
+					v = ten_bit ? (uint8_t)(ir10_back[j] >> 2) : ir_back[j];
+				}
+				rgb_cloud_back[i].x = rgb_cloud_back[i].y = rgb_cloud_back[i].z = v;
+			}
+		}
+	}
 
-		dictionary_getkeys_ordered(d, &numkeys, &keys);
-		for (i=0; i<numkeys; i++) {
-			long	argc = 0;
-			t_atom	*argv = NULL;
-			t_symbol * key = keys[i];
-			
-			post("key %s", keys[i]->s_name);
-			
-			/*
-			key R
-			key T
-			key depth_base_and_offset
-			key depth_distortion
-			key depth_intrinsics
-			key depth_size
-			key raw_depth_size
-			key raw_rgb_size
-			key rgb_distortion
-			key rgb_intrinsics
-			key rgb_size
-			*/
+	// the RGB image at video index i, demosaicing on demand if the frame is left as Bayer:
+	inline vec3c rgb_pixel(int i) {
+		return bayer_lazy ? bayer_pixel(bayer_lazy, i % video_width, i / video_width) : rgb_back[i];
+	}
+
+	// does cloud_rgb_process read only one RGB pixel per point? (if so, it can demosaic lazily)
+	int rgb_single_sample() {
+		return registration == REGISTRATION_HARDWARE || reg_table_usable();
+	}
+
+	static inline uint8_t avg2(int a, int b) {
+		return (a + b + 1) >> 1;	// rounds like _mm_avg_epu8
+	}
+
+	// bilinear demosaic of one pixel of the Kinect's GRBG Bayer pattern
+	// (rows alternate G R G R.. and B G B G..), mirroring at the borders:
+	vec3c bayer_pixel(const uint8_t * bayer, int x, int y) {
+		int xl = x > 0 ? x-1 : x+1;
+		int xr = x < video_width-1 ? x+1 : x-1;
+		const uint8_t * up = bayer + (y > 0 ? y-1 : y+1)*video_width;
+		const uint8_t * row = bayer + y*video_width;
+		const uint8_t * dn = bayer + (y < video_height-1 ? y+1 : y-1)*video_width;
+		
+		uint8_t c = row[x];
+		uint8_t h = avg2(row[xl], row[xr]);
+		uint8_t v = avg2(up[x], dn[x]);
+		uint8_t cross = avg2(h, v);
+		uint8_t diag = avg2(avg2(up[xl], up[xr]), avg2(dn[xl], dn[xr]));
+		vec3c p;
+		if (!(y & 1)) {
+			if (!(x & 1)) {	// green on a red row
+				p.x = h; p.y = c; p.z = v;
+			} else {		// red
+				p.x = c; p.y = cross; p.z = diag;
+			}
+		} else {
+			if (!(x & 1)) {	// blue
+				p.x = diag; p.y = cross; p.z = c;
+			} else {		// green on a blue row
+				p.x = v; p.y = c; p.z = h;
+			}
+		}
+		return p;
+	}
+
+	// demosaic a whole Bayer frame into rgb_back:
+	void demosaic(const uint8_t * bayer) {
+		for (int y=0; y<video_height; y++) {
+			const uint8_t * up = bayer + (y > 0 ? y-1 : y+1)*video_width;
+			const uint8_t * row = bayer + y*video_width;
+			const uint8_t * dn = bayer + (y < video_height-1 ? y+1 : y-1)*video_width;
+			vec3c * out = rgb_back + y*video_width;
+			int x = 0;
 			
-			if (key == gensym("depth_base_and_offset")) {
-				
+		#ifdef MAX_KINECT_SSE2
+			// the same arithmetic as bayer_pixel, 16 pixels at a time away from the borders;
+			// even & odd columns are computed alike, then blended:
+			const __m128i even = _mm_set1_epi16(0x00FF);
+			uint8_t r[16], g[16], b[16];
+			for (; x<16; x++) out[x] = bayer_pixel(bayer, x, y);
+			for (; x+17<=video_width; x+=16) {
+				__m128i c = _mm_loadu_si128((const __m128i *)(row+x));
+				__m128i h = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(row+x-1)), _mm_loadu_si128((const __m128i *)(row+x+1)));
+				__m128i v = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(up+x)), _mm_loadu_si128((const __m128i *)(dn+x)));
+				__m128i cross = _mm_avg_epu8(h, v);
+				__m128i diag = _mm_avg_epu8(
+					_mm_avg_epu8(_mm_loadu_si128((const __m128i *)(up+x-1)), _mm_loadu_si128((const __m128i *)(up+x+1))),
+					_mm_avg_epu8(_mm_loadu_si128((const __m128i *)(dn+x-1)), _mm_loadu_si128((const __m128i *)(dn+x+1))));
+				__m128i R, G, B;
+				if (!(y & 1)) {
+					R = blend8(even, h, c);
+					G = blend8(even, c, cross);
+					B = blend8(even, v, diag);
+				} else {
+					R = blend8(even, diag, v);
+					G = blend8(even, cross, c);
+					B = blend8(even, c, h);
+				}
+				_mm_storeu_si128((__m128i *)r, R);
+				_mm_storeu_si128((__m128i *)g, G);
+				_mm_storeu_si128((__m128i *)b, B);
+				for (int k=0; k<16; k++) {
+					out[x+k].x = r[k];
+					out[x+k].y = g[k];
+					out[x+k].z = b[k];
+				}
+			}
+		#endif
+			for (; x<video_width; x++) out[x] = bayer_pixel(bayer, x, y);
+		}
+	}
+
+#ifdef MAX_KINECT_SSE2
+	// bytes from a where mask is set, else from b:
+	static inline __m128i blend8(__m128i mask, __m128i a, __m128i b) {
+		return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+	}
+#endif
+
+	// timestamp (ms) for profile_end, if profiling:
+	inline double profile_begin() {
+		return profile ? systimer_gettime() : 0.;
+	}
+
+	// accumulate the time since profile_begin into a stage:
+	void profile_end(int stage, double t0) {
+		if (!profile) return;
+		profile_add(stage, systimer_gettime() - t0);
+	}
+	
+	// processing thread: accumulate a duration (ms) into a stage's stats:
+	void profile_add(int stage, double dt) {
+		if (!profile) return;
+		if (stats_reset) {
+			for (int i=0; i<STAGE_COUNT; i++) {
+				stage_stats[i].total = stage_stats[i].max = 0.;
+				stage_stats[i].count = 0;
+			}
+			stats_reset = 0;
+		}
+		stage_stat& s = stage_stats[stage];
+		s.total += dt;
+		if (dt > s.max) s.max = dt;
+		s.count++;
+	}
+
+	// report mean & worst time per stage since the last report (for pair, the time between
+	// the depth & video frames colored together), and the coverage of the last colored cloud as
+	// "stats coverage <colored share of the depth image> <colored share of its points>"
+	// (hardware registration drops the depth it can't map, so only the first compares across modes):
+	void stats() {
+		static const char * names[STAGE_COUNT] = { "depth", "cloud", "rgb", "filter", "blobs", "video", "pair" };
+		t_atom a[6];
+
+		if (!stats_reset) {
+			for (int i=0; i<STAGE_COUNT; i++) {
+				const stage_stat& s = stage_stats[i];
+				if (!s.count) continue;
+				atom_setsym(a+0, gensym(names[i]));
+				atom_setfloat(a+1, s.total / s.count);
+				atom_setfloat(a+2, s.max);
+				atom_setlong(a+3, s.count);
+				outlet_anything(outlet_msg, gensym("stats"), 4, a);
+			}
+			stats_reset = 1;
+		}
+		atom_setsym(a+0, gensym("coverage"));
+		atom_setfloat(a+1, rgb_colored / (double)(depth_width*depth_height));
+		atom_setfloat(a+2, rgb_points ? rgb_colored / (double)rgb_points : 0.);
+		outlet_anything(outlet_msg, gensym("stats"), 3, a);
+		
+		// the group's synchronized sets, as "stats sync <mean skew> <max skew> <sets>"
+		// and "stats unmatched <frames>":
+		if (group_data && group_sync > 0.f) {
+			systhread_mutex_lock(cloud_groups_mutex);
+			cloud_group * g = group_data;
+			if (g) {
+				atom_setsym(a+0, gensym("sync"));
+				atom_setfloat(a+1, g->sets ? g->skew_total / g->sets : 0.);
+				atom_setfloat(a+2, g->skew_max);
+				atom_setlong(a+3, g->sets);
+				atom_setsym(a+4, gensym("unmatched"));
+				atom_setlong(a+5, g->unmatched);
+				g->sets = g->unmatched = 0;
+				g->skew_total = g->skew_max = 0;
+			}
+			systhread_mutex_unlock(cloud_groups_mutex);
+			if (g) {
+				outlet_anything(outlet_msg, gensym("stats"), 4, a);
+				outlet_anything(outlet_msg, gensym("stats"), 2, a+4);
+			}
+		}
+	}
+	
+	// remove a point from the cloud, as if it had no depth:
+	inline void clear_point(int i) {
+		cloud_back[i].x = cloud_back[i].y = cloud_back[i].z = 0.f;
+		if (transform_cloud) trans_cloud_back[i] = trans_translate;
+	}
+
+	// statistical outlier removal over the organized cloud:
+	// each point's mean distance to its outlier_k nearest neighbours within the pixel window
+	// is compared against the mean & standard deviation of that measure over the whole cloud.
+	void outlier_process() {
+		if (outlier_k <= 0) return;
+
+		// rows are shared out among Jitter's worker threads:
+		t_jit_matrix_info in_info, out_info;
+		jit_object_method(cloud_mat, _jit_sym_getinfo, &in_info);
+		jit_object_method(outlier_mat, _jit_sym_getinfo, &out_info);
+		jit_parallel_ndim_simplecalc2((method)outlier_calc_ndim, this,
+			in_info.dimcount, in_info.dim, in_info.planecount,
+			&in_info, (char *)cloud_back, &out_info, (char *)outlier_dist,
+			0, 0);
+
+		// isolated points (no neighbours at all) are marked negative and always removed:
+		double sum = 0., sum2 = 0.;
+		int n = 0;
+		for (int i=0; i<depth_width*depth_height; i++) {
+			float m = outlier_dist[i];
+			if (m > 0.f) {
+				sum += m;
+				sum2 += m*m;
+				n++;
+			}
+		}
+		if (n == 0) return;
+		double mean = sum / n;
+		double var = sum2 / n - mean*mean;
+		float limit = (float)(mean + outlier_alpha * sqrt(var > 0. ? var : 0.));
+
+		for (int i=0; i<depth_width*depth_height; i++) {
+			float m = outlier_dist[i];
+			if (m < 0.f || m > limit) clear_point(i);
+		}
+	}
+
+	// jit_parallel callback; dim[1] rows of the cloud, starting at the row bp1 points to:
+	static void outlier_calc_ndim(MaxKinectBase * x, long dimcount, long * dim, long planecount,
+		t_jit_matrix_info * in_minfo, char * bp1, t_jit_matrix_info * out_minfo, char * bp2) {
+		long y0 = (bp1 - (char *)x->cloud_back) / in_minfo->dimstride[1];
+		x->outlier_rows(y0, y0 + dim[1]);
+	}
+
+	void outlier_rows(long y0, long y1) {
+		const int r = outlier_window < 1 ? 1 : outlier_window > 5 ? 5 : outlier_window;
+		const int k = outlier_k > 120 ? 120 : outlier_k;
+		float nearest[120];
+
+		for (long y=y0; y<y1; y++) {
+			for (int x=0; x<depth_width; x++) {
+				int i = x + y*depth_width;
+				const vec3f& p = cloud_back[i];
+				if (p.z == 0.f) {
+					outlier_dist[i] = 0.f;
+					continue;
+				}
+
+				// keep the k smallest squared distances, in ascending order:
+				int n = 0;
+				int ya = y-r < 0 ? 0 : y-r;
+				int yb = y+r > depth_height-1 ? depth_height-1 : y+r;
+				int xa = x-r < 0 ? 0 : x-r;
+				int xb = x+r > depth_width-1 ? depth_width-1 : x+r;
+				for (int v=ya; v<=yb; v++) {
+					const vec3f * row = cloud_back + v*depth_width;
+					for (int u=xa; u<=xb; u++) {
+						const vec3f& q = row[u];
+						if (q.z == 0.f || (u == x && v == y)) continue;
+						float dx = q.x - p.x, dy = q.y - p.y, dz = q.z - p.z;
+						float d2 = dx*dx + dy*dy + dz*dz;
+						if (n == k && d2 >= nearest[k-1]) continue;
+						int j = (n < k) ? n++ : k-1;
+						while (j > 0 && nearest[j-1] > d2) {
+							nearest[j] = nearest[j-1];
+							j--;
+						}
+						nearest[j] = d2;
+					}
+				}
+				if (n == 0) {
+					outlier_dist[i] = -1.f;
+					continue;
+				}
+				float m = 0.f;
+				for (int j=0; j<n; j++) m += sqrtf(nearest[j]);
+				outlier_dist[i] = m / n;
+			}
+		}
+	}
+
+	// start floor detection on a snapshot of the current cloud;
+	// up (if not NULL) is the expected up direction, e.g. from the accelerometer.
+	// The result is applied by floor_done, on the main thread.
+	void floor_start(const vec3f * up) {
+		if (floor_busy) {
+			object_warn(&ob, "floor detection already in progress");
+			return;
+		}
+		floor_join();
+
+		int n = 0;
+		for (int y=0; y<depth_height; y+=FLOOR_STEP) {
+			for (int x=0; x<depth_width; x+=FLOOR_STEP) {
+				const vec3f& p = cloud_back[x + y*depth_width];
+				if (p.z != 0.f) floor_points[n++] = p;
+			}
+		}
+		if (n < 3) {
+			object_error(&ob, "findfloor: no depth data");
+			return;
+		}
+		floor_npoints = n;
+
+		// without a measured up direction, assume the camera is roughly level:
+		float angle = floor_angle;
+		if (up) {
+			floor_prior = *up;
+		} else {
+			floor_prior.x = 0.f;
+			floor_prior.y = 1.f;
+			floor_prior.z = 0.f;
+			if (angle < 45.f) angle = 45.f;
+		}
+		float len = sqrtf(floor_prior.x*floor_prior.x + floor_prior.y*floor_prior.y + floor_prior.z*floor_prior.z);
+		if (len <= 0.f) {
+			floor_prior.x = floor_prior.z = 0.f;
+			floor_prior.y = len = 1.f;
+		}
+		floor_prior.x /= len;
+		floor_prior.y /= len;
+		floor_prior.z /= len;
+		floor_prior_cos = cosf(angle * 0.01745329252f);
+
+		floor_busy = 1;
+		if (systhread_create((method)&floor_threadfunc, this, 0, 0, 0, &floor_thread)) {
+			object_error(&ob, "Failed to create floor detection thread.");
+			floor_thread = 0;
+			floor_busy = 0;
+		}
+	}
+
+	// wait for the floor detection thread, if any
+	// (its result is still applied by floor_qelem, if it found one):
+	void floor_join() {
+		if (floor_thread) {
+			unsigned int ret;
+			systhread_join(floor_thread, &ret);
+			floor_thread = 0;
+		}
+	}
+
+	static void *floor_threadfunc(void *arg) {
+		MaxKinectBase *x = (MaxKinectBase *)arg;
+		x->floor_ransac();
+		qelem_set(x->floor_qelem);
+		systhread_exit(0);
+		return NULL;
+	}
+
+	// RANSAC over floor_points for the plane with most inliers that faces floor_prior
+	// and lies below the camera, refined by a least-squares fit to those inliers:
+	void floor_ransac() {
+		const int n = floor_npoints;
+		const float tol = floor_tolerance;
+		uint32_t seed = 0x9E3779B9u ^ (uint32_t)n;
+		int best = 0;
+		vec3f bn = floor_prior;
+		float bd = 0.f;
+
+		for (int it=0; it<FLOOR_ITERATIONS; it++) {
+			// xorshift for three sample indices:
+			int s[3];
+			for (int j=0; j<3; j++) {
+				seed ^= seed << 13;
+				seed ^= seed >> 17;
+				seed ^= seed << 5;
+				s[j] = seed % n;
+			}
+			const vec3f& a = floor_points[s[0]];
+			const vec3f& b = floor_points[s[1]];
+			const vec3f& c = floor_points[s[2]];
+			float ux = b.x - a.x, uy = b.y - a.y, uz = b.z - a.z;
+			float vx = c.x - a.x, vy = c.y - a.y, vz = c.z - a.z;
+			vec3f nn;
+			nn.x = uy*vz - uz*vy;
+			nn.y = uz*vx - ux*vz;
+			nn.z = ux*vy - uy*vx;
+			float len = sqrtf(nn.x*nn.x + nn.y*nn.y + nn.z*nn.z);
+			if (len < 1e-6f) continue;
+			nn.x /= len;
+			nn.y /= len;
+			nn.z /= len;
+			float cosa = nn.x*floor_prior.x + nn.y*floor_prior.y + nn.z*floor_prior.z;
+			if (cosa < 0.f) {
+				nn.x = -nn.x;
+				nn.y = -nn.y;
+				nn.z = -nn.z;
+				cosa = -cosa;
+			}
+			if (cosa < floor_prior_cos) continue;
+			float d = -(nn.x*a.x + nn.y*a.y + nn.z*a.z);
+			// the camera (origin) must be above the floor:
+			if (d <= 0.f) continue;
+
+			int count = 0;
+			for (int i=0; i<n; i++) {
+				const vec3f& p = floor_points[i];
+				float e = nn.x*p.x + nn.y*p.y + nn.z*p.z + d;
+				count += (e < tol && e > -tol);
+			}
+			if (count > best) {
+				best = count;
+				bn = nn;
+				bd = d;
+			}
+		}
+
+		floor_inliers = best;
+		if (best < 3) {
+			floor_inliers = 0;
+			return;
+		}
+
+		// least-squares refinement: the normal is the covariance's smallest eigenvector,
+		// found by power iteration on (trace * I - covariance), starting from the RANSAC normal.
+		double cx = 0., cy = 0., cz = 0.;
+		int m = 0;
+		for (int i=0; i<n; i++) {
+			const vec3f& p = floor_points[i];
+			float e = bn.x*p.x + bn.y*p.y + bn.z*p.z + bd;
+			if (e < tol && e > -tol) {
+				cx += p.x;
+				cy += p.y;
+				cz += p.z;
+				m++;
+			}
+		}
+		cx /= m;
+		cy /= m;
+		cz /= m;
+		double c[3][3] = { { 0., 0., 0. }, { 0., 0., 0. }, { 0., 0., 0. } };
+		for (int i=0; i<n; i++) {
+			const vec3f& p = floor_points[i];
+			float e = bn.x*p.x + bn.y*p.y + bn.z*p.z + bd;
+			if (e < tol && e > -tol) {
+				double q[3] = { p.x - cx, p.y - cy, p.z - cz };
+				for (int r=0; r<3; r++) for (int k=0; k<3; k++) c[r][k] += q[r]*q[k];
+			}
+		}
+		double tr = c[0][0] + c[1][1] + c[2][2];
+		double v[3] = { bn.x, bn.y, bn.z };
+		for (int it=0; it<50; it++) {
+			double w[3];
+			for (int r=0; r<3; r++) {
+				w[r] = tr*v[r] - (c[r][0]*v[0] + c[r][1]*v[1] + c[r][2]*v[2]);
+			}
+			double len = sqrt(w[0]*w[0] + w[1]*w[1] + w[2]*w[2]);
+			if (len <= 0.) break;
+			v[0] = w[0]/len;
+			v[1] = w[1]/len;
+			v[2] = w[2]/len;
+		}
+		if (v[0]*bn.x + v[1]*bn.y + v[2]*bn.z < 0.) {
+			v[0] = -v[0];
+			v[1] = -v[1];
+			v[2] = -v[2];
+		}
+		floor_normal.x = (float)v[0];
+		floor_normal.y = (float)v[1];
+		floor_normal.z = (float)v[2];
+		floor_offset = (float)-(v[0]*cx + v[1]*cy + v[2]*cz);
+	}
+
+	// queue a device command for the control thread (main thread), starting the thread
+	// (threadfunc, from the driver layer) if needed. consecutive updates are merged:
+	void control_post(int type, long argc, t_atom * argv, method threadfunc) {
+		systhread_mutex_lock(control_mutex);
+		if (type == COMMAND_UPDATE && control_count 
+			&& control_queue[(control_first + control_count - 1) % MAX_COMMANDS].type == COMMAND_UPDATE) {
+			systhread_mutex_unlock(control_mutex);
+			return;
+		}
+		if (control_count == MAX_COMMANDS) {
+			systhread_mutex_unlock(control_mutex);
+			object_error(&ob, "too many device commands pending");
+			return;
+		}
+		device_command& c = control_queue[(control_first + control_count) % MAX_COMMANDS];
+		c.type = type;
+		c.argc = argc > 0 ? 1 : 0;
+		if (c.argc) c.arg = argv[0];
+		control_count++;
+		systhread_cond_signal(control_cond);
+		systhread_mutex_unlock(control_mutex);
+		
+		if (!control_thread) {
+			control_running = 1;
+			if (systhread_create(threadfunc, this, 0, 0, 0, &control_thread)) {
+				object_error(&ob, "Failed to create device control thread.");
+				control_running = 0;
+				control_thread = 0;
+			}
+		}
+	}
+	
+	// control thread: wait for the next command, or until the watchdog is due (COMMAND_WATCHDOG),
+	// and take device_mutex for it. returns 0 once the thread should stop:
+	int control_next(device_command& c) {
+		c.type = COMMAND_WATCHDOG;
+		systhread_mutex_lock(control_mutex);
+		while (control_running && !control_count) {
+			long ms = watchdog_wait();
+			if (ms == 0) break;
+			if (ms < 0) {
+				systhread_cond_wait(control_cond, control_mutex);
+			} else {
+				systhread_cond_timedwait(control_cond, control_mutex, ms);
+			}
+		}
+		if (!control_running) {
+			systhread_mutex_unlock(control_mutex);
+			return 0;
+		}
+		if (control_count) {
+			c = control_queue[control_first];
+			control_first = (control_first + 1) % MAX_COMMANDS;
+			control_count--;
+		}
+		systhread_mutex_unlock(control_mutex);
+		
+		systhread_mutex_lock(device_mutex);
+		return 1;
+	}
+	
+	// control thread: the command is done:
+	void control_done() {
+		systhread_mutex_unlock(device_mutex);
+	}
+	
+	// stop the control thread, dropping any commands it hasn't started (main thread):
+	void control_stop() {
+		if (!control_thread) return;
+		systhread_mutex_lock(control_mutex);
+		control_running = 0;
+		control_count = 0;
+		systhread_cond_signal(control_cond);
+		systhread_mutex_unlock(control_mutex);
+		
+		unsigned int ret;
+		systhread_join(control_thread, &ret);
+		control_thread = 0;
+	}
+	
+	// ms until the watchdog is due, or -1 if it has nothing to watch:
+	long watchdog_wait() {
+		double due;
+		if (reopen_time) {
+			due = reopen_time;
+		} else if (device_state == DEVICE_STREAMING && watchdog > 0) {
+			due = frame_time + watchdog;
+		} else {
+			return -1;
+		}
+		double ms = ceil(due - systimer_gettime());
+		return ms > 0 ? (long)ms : 0;
+	}
+	
+	// control thread: the device opened as asked, so stop any reconnection & restart the clock:
+	void watchdog_reset(int opened) {
+		reopen_time = 0;
+		reopen_delay = REOPEN_DELAY_MIN;
+		if (opened) frame_time = systimer_gettime();
+	}
+	
+	// control thread: has the streaming device stopped sending frames?
+	// if so, the caller closes it, and reopening is scheduled:
+	int watchdog_lost() {
+		if (reopen_time || device_state != DEVICE_STREAMING || watchdog <= 0) return 0;
+		double now = systimer_gettime();
+		if (now - frame_time < watchdog) return 0;
+		object_warn(&ob, "no frames for %ld ms; reopening the device", (long)(now - frame_time));
+		set_device_state(DEVICE_ERROR);
+		reopen_delay = REOPEN_DELAY_MIN;
+		reopen_time = now + reopen_delay;
+		return 1;
+	}
+	
+	// control thread: is it time to try reopening the lost device?
+	int watchdog_reopen_due() {
+		return reopen_time && systimer_gettime() >= reopen_time;
+	}
+	
+	// control thread: the outcome of a reopening attempt; failures back off exponentially:
+	void watchdog_reopened(int ok) {
+		if (ok) {
+			object_post(&ob, "device reopened");
+			watchdog_reset(1);
+			set_device_state(DEVICE_STREAMING);
+			return;
+		}
+		reopen_delay *= 2;
+		if (reopen_delay > REOPEN_DELAY_MAX) reopen_delay = REOPEN_DELAY_MAX;
+		reopen_time = systimer_gettime() + reopen_delay;
+		set_device_state(DEVICE_ERROR);
+	}
+	
+	// any thread; the main thread reports the change when it gets to it
+	// (if it falls MAX_STATES behind, the oldest changes are dropped):
+	void set_device_state(long state) {
+		systhread_mutex_lock(state_mutex);
+		device_state = state;
+		if (state_count == MAX_STATES) {
+			state_first = (state_first + 1) % MAX_STATES;
+			state_count--;
+		}
+		state_queue[(state_first + state_count++) % MAX_STATES] = state;
+		systhread_mutex_unlock(state_mutex);
+		qelem_set(state_qelem);
+	}
+	
+	static void state_qfn(MaxKinectBase *x) {
+		x->state_output();
+	}
+	
+	// "state closed|opening|streaming|error|closing", for each change in turn:
+	void state_output() {
+		static const char * names[] = { "closed", "opening", "streaming", "error", "closing" };
+		long states[MAX_STATES];
+		systhread_mutex_lock(state_mutex);
+		int n = state_count;
+		for (int i=0; i<n; i++) states[i] = state_queue[(state_first + i) % MAX_STATES];
+		state_first = state_count = 0;
+		systhread_mutex_unlock(state_mutex);
+		
+		t_atom a[1];
+		for (int i=0; i<n; i++) {
+			atom_setsym(a, gensym(names[states[i]]));
+			outlet_anything(outlet_msg, gensym("state"), 1, a);
+		}
+	}
+	
+	static void floor_qfn(MaxKinectBase *x) {
+		if (x->floor_deferred == 2) {
+			// the deferred findfloor has a cloud now:
+			x->floor_request();
+		} else if (x->floor_busy) {
+			x->floor_done();
+		}
+	}
+	
+	// processing thread: a new cloud is in cloud_back
+	void floor_cloud_ready() {
+		if (floor_deferred == 1) {
+			floor_deferred = 2;
+			qelem_set(floor_qelem);
+		}
+	}
+
+	// apply the detected floor: rotate its normal onto +y and lift it to y = 0,
+	// then report "floor <nx> <ny> <nz> <d> <inliers>":
+	void floor_done() {
+		floor_busy = 0;
+		if (!floor_inliers) {
+			object_error(&ob, "findfloor: no floor plane found");
+			return;
+		}
+
+		const vec3f& n = floor_normal;
+		vec3f gravity[3];
+		if (gravity_align && accel_read(NULL, NULL, gravity)) {
+			// the normal was measured before gravity alignment, so undo it:
+			vec3f floor_rotate[3];
+			rotation_to_up(n, floor_rotate);
+			mat3_mul_transpose(floor_rotate, gravity, trans_rotate);
+		} else {
+			rotation_to_up(n, trans_rotate);
+		}
+
+		// after rotation, floor points have y = -d:
+		trans_translate.x = 0.f;
+		trans_translate.y = floor_offset;
+		trans_translate.z = 0.f;
+		transform_cloud = 1;
+		object_attr_touch(&ob, gensym("trans_rotate"));
+		object_attr_touch(&ob, gensym("trans_translate"));
+		object_attr_touch(&ob, gensym("transform_cloud"));
+
+		t_atom a[5];
+		atom_setfloat(a+0, n.x);
+		atom_setfloat(a+1, n.y);
+		atom_setfloat(a+2, n.z);
+		atom_setfloat(a+3, floor_offset);
+		atom_setlong(a+4, floor_inliers);
+		outlet_anything(outlet_msg, gensym("floor"), 5, a);
+	}
+
+	// Rodrigues rotation (as rows) taking the unit vector n to (0, 1, 0), about axis n x up:
+	static void rotation_to_up(const vec3f& n, vec3f * m) {
+		float vx = -n.z, vy = 0.f, vz = n.x;	// n x (0,1,0)
+		float c = n.y;
+		float s2 = vx*vx + vz*vz;
+		float k = s2 > 1e-12f ? (1.f - c) / s2 : 0.f;
+		m[0].x = 1.f + k*(-vz*vz - vy*vy);
+		m[0].y = -vz + k*(vx*vy);
+		m[0].z = vy + k*(vx*vz);
+		m[1].x = vz + k*(vx*vy);
+		m[1].y = 1.f + k*(-vz*vz - vx*vx);
+		m[1].z = -vx + k*(vy*vz);
+		m[2].x = -vy + k*(vx*vz);
+		m[2].y = vx + k*(vy*vz);
+		m[2].z = 1.f + k*(-vy*vy - vx*vx);
+	}
+
+	// out = a * b (row-major 3x3):
+	static void mat3_mul(const vec3f * a, const vec3f * b, vec3f * out) {
+		for (int r=0; r<3; r++) {
+			out[r].x = a[r].x*b[0].x + a[r].y*b[1].x + a[r].z*b[2].x;
+			out[r].y = a[r].x*b[0].y + a[r].y*b[1].y + a[r].z*b[2].y;
+			out[r].z = a[r].x*b[0].z + a[r].y*b[1].z + a[r].z*b[2].z;
+		}
+	}
+
+	// out = a * transpose(b):
+	static void mat3_mul_transpose(const vec3f * a, const vec3f * b, vec3f * out) {
+		for (int r=0; r<3; r++) {
+			out[r].x = a[r].x*b[0].x + a[r].y*b[0].y + a[r].z*b[0].z;
+			out[r].y = a[r].x*b[1].x + a[r].y*b[1].y + a[r].z*b[1].z;
+			out[r].z = a[r].x*b[2].x + a[r].y*b[2].y + a[r].z*b[2].z;
+		}
+	}
+
+	// rotation applied to the transformed cloud: trans_rotate, after gravity alignment if enabled.
+	void cloud_rotation(vec3f * rotate) {
+		vec3f gravity[3];
+		if (gravity_align && accel_read(NULL, NULL, gravity)) {
+			mat3_mul(trans_rotate, gravity, rotate);
+		} else {
+			rotate[0] = trans_rotate[0];
+			rotate[1] = trans_rotate[1];
+			rotate[2] = trans_rotate[2];
+		}
+	}
+
+	// is an accelerometer poll due? (capture thread)
+	int accel_due() {
+		double now = systime_ms();
+		if (now - accel_time < accel_interval) return 0;
+		accel_time = now;
+		return 1;
+	}
+
+	// store a fresh accelerometer reading (capture thread);
+	// up is the measured up direction in cloud axes, of any length.
+	void accel_store(const vec3f& raw, vec3f up) {
+		float len = sqrtf(up.x*up.x + up.y*up.y + up.z*up.z);
+		if (len <= 0.f) return;
+		// the device is assumed to be roughly upright:
+		if (up.y < 0.f) len = -len;
+		up.x /= len;
+		up.y /= len;
+		up.z /= len;
+
+		vec3f rotate[3];
+		rotation_to_up(up, rotate);
+
+		systhread_mutex_lock(accel_mutex);
+		accel_raw = raw;
+		accel_up = up;
+		gravity_rotate[0] = rotate[0];
+		gravity_rotate[1] = rotate[1];
+		gravity_rotate[2] = rotate[2];
+		accel_valid = 1;
+		systhread_mutex_unlock(accel_mutex);
+	}
+
+	// copy out the cached reading; any argument may be NULL.
+	// returns 0 if there is no reading yet.
+	int accel_read(vec3f * raw, vec3f * up, vec3f * rotate) {
+		systhread_mutex_lock(accel_mutex);
+		int valid = accel_valid;
+		if (valid) {
+			if (raw) *raw = accel_raw;
+			if (up) *up = accel_up;
+			if (rotate) {
+				rotate[0] = gravity_rotate[0];
+				rotate[1] = gravity_rotate[1];
+				rotate[2] = gravity_rotate[2];
+			}
+		}
+		systhread_mutex_unlock(accel_mutex);
+		return valid;
+	}
+
+	void accel_clear() {
+		systhread_mutex_lock(accel_mutex);
+		accel_valid = 0;
+		accel_time = 0;
+		systhread_mutex_unlock(accel_mutex);
+	}
+
+	// output the latest cached accelerometer reading:
+	void accel() {
+		vec3f raw;
+		if (!accel_read(&raw, NULL, NULL)) return;
+
+		t_atom a[3];
+		atom_setfloat(a+0, raw.x);
+		atom_setfloat(a+1, raw.y);
+		atom_setfloat(a+2, raw.z);
+		outlet_anything(outlet_msg, gensym("accel"), 3, a);
+	}
+
+	// detect the floor plane, optionally seeded by the accelerometer:
+	void findfloor(long use_accel) {
+		if (floor_busy) {
+			object_warn(&ob, "floor detection already in progress");
+			return;
+		}
+		floor_use_up = use_accel && accel_read(NULL, &floor_up, NULL);
+		floor_request();
+	}
+	
+	// start floor detection on the current cloud, or wait for the next one if it is stale
+	// (nothing else uses it) or the control thread is resizing it:
+	void floor_request() {
+		if (!(products_stale & PRODUCT_CLOUD) && !systhread_mutex_trylock(device_mutex)) {
+			floor_deferred = 0;
+			floor_start(floor_use_up ? &floor_up : NULL);
+			systhread_mutex_unlock(device_mutex);
+		} else {
+			floor_deferred = 1;
+		}
+	}
+
+	// thin the output cloud to one point per voxel_size cube, in place:
+	// the survivor stays at the cloud index of the voxel's first point
+	// (so the cloud remains organized and aligned with the RGB cloud),
+	// and all other points in that voxel are cleared.
+	void voxel_process() {
+		if (voxel_size <= 0.f) return;
+
+		vec3f * pts = transform_cloud ? trans_cloud_back : cloud_back;
+		const float inv = 1.f/voxel_size;
+		const int centroid = voxel_mode;
+		int used = 0;
+
+		for (int i=0; i<depth_width*depth_height; i++) {
+			if (cloud_back[i].z == 0.f) continue;
+			vec3f p = pts[i];
+
+			// 21 bits per axis, offset so that negative coordinates pack too:
+			int32_t kx = (int32_t)floorf(p.x * inv);
+			int32_t ky = (int32_t)floorf(p.y * inv);
+			int32_t kz = (int32_t)floorf(p.z * inv);
+			uint64_t key = ((uint64_t)((kx + (1<<20)) & 0x1FFFFF))
+						 | ((uint64_t)((ky + (1<<20)) & 0x1FFFFF) << 21)
+						 | ((uint64_t)((kz + (1<<20)) & 0x1FFFFF) << 42);
+			uint32_t h = ((uint32_t)kx * 73856093u) ^ ((uint32_t)ky * 19349663u) ^ ((uint32_t)kz * 83492791u);
+			h &= VOXEL_TABLE_SIZE-1;
+
+			while (voxel_table[h].key != VOXEL_EMPTY && voxel_table[h].key != key) {
+				h = (h+1) & (VOXEL_TABLE_SIZE-1);
+			}
+			voxel& v = voxel_table[h];
+			if (v.key == VOXEL_EMPTY) {
+				v.key = key;
+				v.first = i;
+				v.count = 1;
+				voxel_used[used++] = h;
+			} else {
+				if (centroid) {
+					vec3f& q = pts[v.first];
+					q.x += p.x;
+					q.y += p.y;
+					q.z += p.z;
+				}
+				v.count++;
+				clear_point(i);
+			}
+		}
+
+		// finish centroids, and empty the table for the next frame:
+		for (int j=0; j<used; j++) {
+			voxel& v = voxel_table[voxel_used[j]];
+			if (centroid && v.count > 1) {
+				float s = 1.f/v.count;
+				vec3f& q = pts[v.first];
+				q.x *= s;
+				q.y *= s;
+				q.z *= s;
+			}
+			v.key = VOXEL_EMPTY;
+		}
+	}
+
+	// join the named fusion group, leaving any previous one; an empty name just leaves (main thread).
+	// the group's matrix then goes out the cloud outlet instead of this device's own cloud:
+	void set_group(t_symbol * name) {
+		if (!cloud_groups_mutex) systhread_mutex_new(&cloud_groups_mutex, 0);
+		systhread_mutex_lock(cloud_groups_mutex);
+		group_leave();
+		group = name ? name : gensym("");
+		// a rejected join leaves the device in no group, and the attribute says so:
+		if (group != gensym("") && !group_join(group)) group = gensym("");
+		systhread_mutex_unlock(cloud_groups_mutex);
+	}
+
+	// cloud_groups_mutex held; returns 0 if the group can't be joined:
+	int group_join(t_symbol * name) {
+		cloud_group * g = NULL;
+		int free_group = -1;
+		for (int i=0; i<MAX_GROUPS; i++) {
+			if (cloud_groups[i] && cloud_groups[i]->name == name) {
+				g = cloud_groups[i];
+			} else if (!cloud_groups[i] && free_group < 0) {
+				free_group = i;
+			}
+		}
+		if (!g) {
+			if (free_group < 0) {
+				object_error(&ob, "too many groups");
+				return 0;
+			}
+			g = (cloud_group *)sysmem_newptrclear(sizeof(cloud_group));
+			g->name = name;
+			g->mat_wrapper = jit_object_new(gensym("jit_matrix_wrapper"), jit_symbol_unique(), 0, NULL);
+			g->mat = jit_object_method(g->mat_wrapper, _jit_sym_getmatrix);
+			// cache name:
+			atom_setsym(g->mat_name, jit_attr_getsym(g->mat_wrapper, _jit_sym_name));
+			systhread_mutex_new(&g->out_mutex, SYSTHREAD_MUTEX_RECURSIVE);
+			cloud_groups[free_group] = g;
+		}
+		
+		int slot = -1;
+		for (int k=0; k<MAX_GROUP_MEMBERS; k++) {
+			if (!g->members[k]) {
+				slot = k;
+				break;
+			}
+		}
+		if (slot < 0) {
+			object_error(&ob, "group %s already has %d devices", name->s_name, MAX_GROUP_MEMBERS);
+			return 0;
+		}
+		// (kept once allocated, as the processing thread may still be compacting into it)
+		if (!group_stage) group_stage = (float *)sysmem_newptr(depth_width*depth_height * 4 * sizeof(float));
+		g->members[slot] = this;
+		group_slot = slot;
+		group_resize(g);
+		group_ring_alloc(g);
+		group_data = g;
+		return 1;
+	}
+
+	// cloud_groups_mutex held:
+	void group_leave() {
+		cloud_group * g = group_data;
+		if (!g) return;
+		group_data = NULL;
+		g->members[group_slot] = NULL;
+		group_ring_free(g, group_slot);
+		
+		int members = 0;
+		for (int k=0; k<MAX_GROUP_MEMBERS; k++) {
+			if (g->members[k]) members++;
+		}
+		if (members) {
+			// don't leave this device's last points behind:
+			memset(g->back + group_slot * g->width * 4, 0, g->used[group_slot] * 4 * sizeof(float));
+			g->used[group_slot] = 0;
+			g->changed = 1;
+			group_resize(g);
+		} else {
+			for (int i=0; i<MAX_GROUPS; i++) {
+				if (cloud_groups[i] == g) cloud_groups[i] = NULL;
+			}
+			object_free(g->mat_wrapper);
+			systhread_mutex_free(g->out_mutex);
+			for (int k=0; k<MAX_GROUP_MEMBERS; k++) group_ring_free(g, k);
+			if (g->back) sysmem_freeptr(g->back);
+			sysmem_freeptr(g);
+		}
+		group_slot = -1;
+	}
+
+	// size a group's rows for its members: rows up to the last member's slot,
+	// each as long as the largest member's depth frame (the matrix follows when next sent).
+	// cloud_groups_mutex held.
+	static void group_resize(cloud_group * g) {
+		int width = 0, rows = 0;
+		for (int k=0; k<MAX_GROUP_MEMBERS; k++) {
+			MaxKinectBase * m = g->members[k];
+			if (!m) continue;
+			rows = k+1;
+			if (m->depth_width*m->depth_height > width) width = m->depth_width*m->depth_height;
+		}
+		if (width == g->width && rows == g->rows) return;
+		
+		if (g->back) sysmem_freeptr(g->back);
+		g->back = (float *)sysmem_newptrclear(width * rows * 4 * sizeof(float));
+		g->changed = 1;
+		int reallocate = width != g->width;
+		if (reallocate) {
+			// buffered frames are sized for the rows:
+			for (int k=0; k<MAX_GROUP_MEMBERS; k++) group_ring_free(g, k);
+			g->set_time = 0;
+		}
+		g->width = width;
+		g->rows = rows;
+		for (int k=0; k<MAX_GROUP_MEMBERS; k++) g->used[k] = 0;
+		if (reallocate) group_ring_alloc(g);
+	}
+	
+	// main or control thread: set this device's group_sync, buffering the group's frames if
+	// any member now syncs:
+	void set_group_sync(float ms) {
+		group_sync = ms < 0.f ? 0.f : ms;
+		if (!cloud_groups_mutex) return;
+		systhread_mutex_lock(cloud_groups_mutex);
+		if (group_data) group_ring_alloc(group_data);
+		systhread_mutex_unlock(cloud_groups_mutex);
+	}
+	
+	// if any member syncs, allocate the frame buffers its members don't have yet, so that
+	// the processing threads never do. cloud_groups_mutex held:
+	static void group_ring_alloc(cloud_group * g) {
+		int sync = 0;
+		for (int k=0; k<MAX_GROUP_MEMBERS; k++) {
+			if (g->members[k] && g->members[k]->group_sync > 0.f) sync = 1;
+		}
+		if (!sync) return;
+		for (int k=0; k<MAX_GROUP_MEMBERS; k++) {
+			if (!g->members[k]) continue;
+			for (int j=0; j<SYNC_FRAMES; j++) {
+				if (!g->ring[k][j]) g->ring[k][j] = (float *)sysmem_newptr(g->width * 4 * sizeof(float));
+			}
+		}
+	}
+	
+	static void group_ring_free(cloud_group * g, int slot) {
+		for (int j=0; j<SYNC_FRAMES; j++) {
+			if (g->ring[slot][j]) sysmem_freeptr(g->ring[slot][j]);
+			g->ring[slot][j] = NULL;
+			g->ring_time[slot][j] = 0;
+		}
+		g->ring_next[slot] = 0;
+	}
+
+	// write the valid points of the output cloud, compacted, into this device's row
+	// of the group matrix, with slot+1 as device id; the rest of the row stays zero.
+	// with group_sync, the frame is buffered instead, and rows are only written with
+	// matched sets (group_match).
+	// the points are compacted into group_stage first, so that the members' processing
+	// threads only hold cloud_groups_mutex to copy them in:
+	void group_process() {
+		if (!group_data) return;
+		int slot = group_slot;
+		int n = group_compact(group_stage, slot);
+		systhread_mutex_lock(cloud_groups_mutex);
+		cloud_group * g = group_data;
+		// (unless the device left the group, or moved to another, meanwhile)
+		if (g && group_slot == slot) {
+			// the group syncs if any member asks to, with the loosest tolerance asked for:
+			float tolerance = 0.f;
+			for (int k=0; k<MAX_GROUP_MEMBERS; k++) {
+				if (g->members[k] && g->members[k]->group_sync > tolerance) tolerance = g->members[k]->group_sync;
+			}
+			if (tolerance <= 0.f) {
+				group_row(g, slot, group_stage, n);
+			} else {
+				int j = g->ring_next[slot];
+				if (!g->ring[slot][j]) {
+					// (group_ring_alloc couldn't allocate it)
+					g->unmatched++;
+					systhread_mutex_unlock(cloud_groups_mutex);
+					return;
+				}
+				if (g->ring_time[slot][j] && !g->ring_sent[slot][j]) {
+					g->unmatched++;
+				}
+				memcpy(g->ring[slot][j], group_stage, n * 4 * sizeof(float));
+				g->ring_used[slot][j] = n;
+				g->ring_time[slot][j] = depth_time;
+				g->ring_sent[slot][j] = 0;
+				g->ring_next[slot] = (j+1) % SYNC_FRAMES;
+				group_match(g, tolerance);
+			}
+		}
+		systhread_mutex_unlock(cloud_groups_mutex);
+	}
+	
+	// compact the valid points of the output cloud into dst as (x, y, z, slot+1); returns how many:
+	int group_compact(float * dst, int slot) {
+		const vec3f * pts = transform_cloud ? trans_cloud_back : cloud_back;
+		float id = (float)(slot + 1);
+		int cells = depth_width*depth_height;
+		int n = 0;
+		for (int i=0; i<cells; i++) {
+			if (cloud_back[i].z == 0.f) continue;
+			float * o = dst + n*4;
+			o[0] = pts[i].x;
+			o[1] = pts[i].y;
+			o[2] = pts[i].z;
+			o[3] = id;
+			n++;
+		}
+		return n;
+	}
+	
+	// put n compacted points into a member's row, clearing whatever the previous frame
+	// left beyond them. cloud_groups_mutex held:
+	static void group_row(cloud_group * g, int slot, const float * points, int n) {
+		float * row = g->back + slot * g->width * 4;
+		if (points != row) memcpy(row, points, n * 4 * sizeof(float));
+		if (g->used[slot] > n) {
+			memset(row + n*4, 0, (g->used[slot] - n) * 4 * sizeof(float));
+		}
+		g->used[slot] = n;
+		g->changed = 1;
+	}
+	
+	// main thread: send the group's matrix, first copying in the rows written since the last send
+	// (only the points each row holds, and zeros where it held more):
+	void group_output() {
+		cloud_group * g = group_data;
+		systhread_mutex_lock(g->out_mutex);
+		systhread_mutex_lock(cloud_groups_mutex);
+		if (g->changed) {
+			t_jit_matrix_info info;
+			jit_object_method(g->mat, _jit_sym_getinfo, &info);
+			if (info.dimcount != 2 || info.dim[0] != g->width || info.dim[1] != g->rows) {
+				jit_matrix_info_default(&info);
+				info.flags |= JIT_MATRIX_DATA_PACK_TIGHT;
+				info.planecount = 4;
+				info.type = _jit_sym_float32;
+				info.dimcount = 2;
+				info.dim[0] = g->width;
+				info.dim[1] = g->rows;
+				jit_object_method(g->mat, _jit_sym_setinfo_ex, &info);
+				jit_object_method(g->mat, _jit_sym_clear);
+				for (int k=0; k<MAX_GROUP_MEMBERS; k++) g->mat_used[k] = 0;
+			}
+			float * data;
+			jit_object_method(g->mat, _jit_sym_getdata, &data);
+			for (int k=0; k<g->rows; k++) {
+				float * dst = data + k * g->width * 4;
+				int n = g->used[k];
+				memcpy(dst, g->back + k * g->width * 4, n * 4 * sizeof(float));
+				if (g->mat_used[k] > n) memset(dst + n*4, 0, (g->mat_used[k] - n) * 4 * sizeof(float));
+				g->mat_used[k] = n;
+			}
+			g->changed = 0;
+		}
+		systhread_mutex_unlock(cloud_groups_mutex);
+		outlet_anything(outlet_cloud, _jit_sym_jit_matrix, 1, g->mat_name);
+		systhread_mutex_unlock(g->out_mutex);
+	}
+	
+	// find the newest complete set of buffered frames: one per member, all within tolerance ms
+	// after the set's earliest, with that earliest as late as possible. if it is newer than
+	// the last set written, write it to the rows. cloud_groups_mutex held:
+	static void group_match(cloud_group * g, float tolerance) {
+		int pick[MAX_GROUP_MEMBERS], best[MAX_GROUP_MEMBERS];
+		double best_time = g->set_time, best_skew = 0;
+		int found = 0;
+		for (int a=0; a<MAX_GROUP_MEMBERS; a++) {
+			if (!g->members[a]) continue;
+			for (int s=0; s<SYNC_FRAMES; s++) {
+				// try each buffered frame as the earliest of a set:
+				double t0 = g->ring_time[a][s];
+				if (t0 <= best_time) continue;
+				double t1 = t0;
+				int complete = 1;
+				for (int k=0; k<MAX_GROUP_MEMBERS && complete; k++) {
+					if (!g->members[k]) continue;
+					// this member's first frame from t0 on, if within tolerance:
+					pick[k] = -1;
+					for (int j=0; j<SYNC_FRAMES; j++) {
+						double t = g->ring_time[k][j];
+						if (t >= t0 && t - t0 <= tolerance && (pick[k] < 0 || t < g->ring_time[k][pick[k]])) pick[k] = j;
+					}
+					if (pick[k] < 0) {
+						complete = 0;
+					} else if (g->ring_time[k][pick[k]] > t1) {
+						t1 = g->ring_time[k][pick[k]];
+					}
+				}
+				if (!complete) continue;
+				best_time = t0;
+				best_skew = t1 - t0;
+				memcpy(best, pick, sizeof(pick));
+				found = 1;
+			}
+		}
+		if (!found) return;
+		
+		for (int k=0; k<MAX_GROUP_MEMBERS; k++) {
+			if (!g->members[k]) continue;
+			group_row(g, k, g->ring[k][best[k]], g->ring_used[k][best[k]]);
+			g->ring_sent[k][best[k]] = 1;
+		}
+		g->set_time = best_time;
+		g->sets++;
+		g->skew_total += best_skew;
+		if (best_skew > g->skew_max) g->skew_max = best_skew;
+	}
+
+	// start (re)learning the background over the next N depth frames:
+	void learnbg(long frames) {
+		if (frames <= 0) frames = 30;
+		bg_ready = 0;
+		bg_learn_reset = 1;
+		bg_learn_frames = frames;
+		object_post(&ob, "learning background over %ld frames", frames);
+	}
+
+	void clearbg() {
+		bg_learn_frames = 0;
+		bg_ready = 0;
+	}
+
+	// update the background model / foreground mask from depth_back
+	// (runs on the capture thread, before cloud_process):
+	void bg_process() {
+		if (bg_learn_reset) {
+			bg_learn_reset = 0;
+			for (int i=0; i<depth_width*depth_height; i++) {
+				bg_mean[i] = 0.f;
+				bg_var[i] = 0.f;
+				bg_count[i] = 0.f;
+			}
+		}
+		if (bg_learn_frames > 0) {
+			bg_learn();
+			if (--bg_learn_frames == 0) {
+				// convert sum of squared differences to variance:
+				for (int i=0; i<depth_width*depth_height; i++) {
+					if (bg_count[i] > 0.f) bg_var[i] /= bg_count[i];
+				}
+				bg_ready = 1;
+			}
+			return;
+		}
+		if (bg_ready) {
+			bg_segment();
+			new_mask_data = 1;
+		}
+	}
+
+	// accumulate one frame into the per-cell mean & variance (Welford's method);
+	// cells without valid depth are skipped:
+	void bg_learn() {
+		const int cells = depth_width*depth_height;
+		int i = 0;
+	#ifdef MAX_KINECT_SSE2
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 one = _mm_set1_ps(1.f);
+		for (; i <= cells-4; i += 4) {
+			__m128 d = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(depth_back + i)));
+			__m128 valid = _mm_cmpgt_ps(d, zero);
+			__m128 n = _mm_add_ps(_mm_loadu_ps(bg_count + i), _mm_and_ps(valid, one));
+			__m128 mean = _mm_loadu_ps(bg_mean + i);
+			__m128 delta = _mm_sub_ps(d, mean);
+			// n is at least 1 wherever the result is kept:
+			__m128 mean1 = _mm_add_ps(mean, _mm_div_ps(delta, _mm_max_ps(n, one)));
+			__m128 m2 = _mm_mul_ps(delta, _mm_sub_ps(d, mean1));
+			_mm_storeu_ps(bg_count + i, n);
+			_mm_storeu_ps(bg_mean + i, _mm_or_ps(_mm_and_ps(valid, mean1), _mm_andnot_ps(valid, mean)));
+			_mm_storeu_ps(bg_var + i, _mm_add_ps(_mm_loadu_ps(bg_var + i), _mm_and_ps(valid, m2)));
+		}
+	#endif
+		for (; i<cells; i++) {
+			float d = (float)depth_back[i];
+			if (d > 0.f) {
+				float n = bg_count[i] + 1.f;
+				float delta = d - bg_mean[i];
+				bg_mean[i] += delta / n;
+				bg_var[i] += delta * (d - bg_mean[i]);
+				bg_count[i] = n;
+			}
+		}
+	}
+
+	// classify each cell as foreground if it is sufficiently in front of the background,
+	// and let the background slowly follow the cells that are not:
+	void bg_segment() {
+		const int cells = depth_width*depth_height;
+		const float sigma2 = bg_sigma * bg_sigma;
+		const float adapt = bg_adapt < 0.f ? 0.f : bg_adapt > 1.f ? 1.f : bg_adapt;
+		int i = 0;
+	#ifdef MAX_KINECT_SSE2
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 vthresh = _mm_set1_ps(bg_threshold);
+		const __m128 vsigma2 = _mm_set1_ps(sigma2);
+		const __m128 va = _mm_set1_ps(adapt);
+		const __m128 vb = _mm_set1_ps(1.f - adapt);
+		// 16 cells per iteration, so that the 4 float masks pack into one vector of bytes:
+		for (; i <= cells-16; i += 16) {
+			__m128i m[4];
+			for (int k=0; k<4; k++) {
+				int j = i + k*4;
+				__m128 d = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(depth_back + j)));
+				__m128 mean = _mm_loadu_ps(bg_mean + j);
+				__m128 var = _mm_loadu_ps(bg_var + j);
+				__m128 diff = _mm_sub_ps(mean, d);
+				__m128 valid = _mm_cmpgt_ps(d, zero);
+				__m128 unseen = _mm_cmpeq_ps(_mm_loadu_ps(bg_count + j), zero);
+				__m128 nearer = _mm_and_ps(
+					_mm_cmpgt_ps(diff, vthresh),
+					_mm_cmpgt_ps(_mm_mul_ps(diff, diff), _mm_mul_ps(vsigma2, var)));
+				__m128 fg = _mm_and_ps(valid, _mm_or_ps(unseen, nearer));
+				m[k] = _mm_castps_si128(fg);
+				if (adapt > 0.f) {
+					__m128 upd = _mm_andnot_ps(_mm_or_ps(fg, unseen), valid);
+					__m128 delta = _mm_sub_ps(d, mean);
+					__m128 mean1 = _mm_add_ps(mean, _mm_mul_ps(va, delta));
+					__m128 var1 = _mm_mul_ps(vb, _mm_add_ps(var, _mm_mul_ps(va, _mm_mul_ps(delta, delta))));
+					_mm_storeu_ps(bg_mean + j, _mm_or_ps(_mm_and_ps(upd, mean1), _mm_andnot_ps(upd, mean)));
+					_mm_storeu_ps(bg_var + j, _mm_or_ps(_mm_and_ps(upd, var1), _mm_andnot_ps(upd, var)));
+				}
+			}
+			// saturating packs turn the all-ones lanes into 0xFF bytes:
+			__m128i m16a = _mm_packs_epi32(m[0], m[1]);
+			__m128i m16b = _mm_packs_epi32(m[2], m[3]);
+			_mm_storeu_si128((__m128i *)(mask_back + i), _mm_packs_epi16(m16a, m16b));
+		}
+	#endif
+		for (; i<cells; i++) {
+			float d = (float)depth_back[i];
+			float diff = bg_mean[i] - d;
+			int unseen = bg_count[i] == 0.f;
+			int fg = d > 0.f && (unseen || (diff > bg_threshold && diff*diff > sigma2*bg_var[i]));
+			mask_back[i] = fg ? 255 : 0;
+			if (adapt > 0.f && d > 0.f && !fg && !unseen) {
+				float delta = d - bg_mean[i];
+				bg_mean[i] += adapt * delta;
+				bg_var[i] = (1.f - adapt) * (bg_var[i] + adapt * delta * delta);
+			}
+		}
+	}
+
+	// union-find root lookup, with path halving
+	// (parents always have a smaller label than their children):
+	inline int cc_find(int k) {
+		while (cc_parent[k] != k) {
+			cc_parent[k] = cc_parent[cc_parent[k]];
+			k = cc_parent[k];
+		}
+		return k;
+	}
+
+	// label connected regions of the (foreground) cloud and summarize them as blobs
+	// (runs on the capture thread, after cloud_process):
+	void blob_process() {
+		if (!tracking && track_count) track_retire();
+		if (!blobs && !tracking) return;
+
+		const float step = blob_depth_step * 0.001f;
+		const int check_mask = bg_ready;
+		vec3f * pts = transform_cloud ? trans_cloud_back : cloud_back;
+		int next = 1;
+
+		// first pass: provisional labels, merging with the left & upper neighbours
+		// whenever their depth is close enough:
+		for (int i=0, y=0; y<depth_height; y++) {
+			for (int x=0; x<depth_width; x++, i++) {
+				float z = cloud_back[i].z;
+				int on = z != 0.f;
+				if (on && check_mask) {
+					const vec2f& di = depth_map_data[i];
+					on = mask_back[(int)(di.x) + (int)(di.y)*depth_width] != 0;
+				}
+				if (!on) {
+					cc_labels[i] = 0;
+					continue;
+				}
+				int l = 0;
+				if (x > 0 && cc_labels[i-1] && fabsf(z - cloud_back[i-1].z) < step) {
+					l = cc_labels[i-1];
+				}
+				if (y > 0 && cc_labels[i-depth_width] && fabsf(z - cloud_back[i-depth_width].z) < step) {
+					int u = cc_labels[i-depth_width];
+					if (l) {
+						int ra = cc_find(l);
+						int rb = cc_find(u);
+						if (ra < rb) cc_parent[rb] = ra;
+						else if (rb < ra) cc_parent[ra] = rb;
+					} else {
+						l = u;
+					}
+				}
+				if (!l) {
+					l = next++;
+					cc_parent[l] = l;
+				}
+				cc_labels[i] = l;
+			}
+		}
+
+		// resolve each provisional label to a compact label;
+		// parents are always smaller, so they are resolved first:
+		int ncompact = 0;
+		for (int k=1; k<next; k++) {
+			if (cc_parent[k] == k) {
+				cc_parent[k] = ++ncompact;
+				blob& b = cc_blobs[ncompact];
+				b.count = 0;
+				b.centroid.x = b.centroid.y = b.centroid.z = 0.f;
+			} else {
+				cc_parent[k] = cc_parent[cc_parent[k]];
+			}
+		}
+
+		// second pass: relabel and accumulate count, position sum and bounds:
+		for (int i=0; i<depth_width*depth_height; i++) {
+			if (!cc_labels[i]) continue;
+			int l = cc_parent[cc_labels[i]];
+			cc_labels[i] = l;
+			blob& b = cc_blobs[l];
+			const vec3f& p = pts[i];
+			if (b.count == 0) {
+				b.min = p;
+				b.max = p;
+			} else {
+				if (p.x < b.min.x) b.min.x = p.x; else if (p.x > b.max.x) b.max.x = p.x;
+				if (p.y < b.min.y) b.min.y = p.y; else if (p.y > b.max.y) b.max.y = p.y;
+				if (p.z < b.min.z) b.min.z = p.z; else if (p.z > b.max.z) b.max.z = p.z;
+			}
+			b.centroid.x += p.x;
+			b.centroid.y += p.y;
+			b.centroid.z += p.z;
+			b.count++;
+		}
+
+		// keep the largest blobs (insertion into a short sorted list),
+		// remembering which output slot each compact label went to:
+		int maxblobs = blob_max < 1 ? 1 : blob_max > MAX_BLOBS ? MAX_BLOBS : blob_max;
+		int order[MAX_BLOBS];
+		int n = 0;
+		for (int l=1; l<=ncompact; l++) {
+			int count = cc_blobs[l].count;
+			if (count < blob_min_points) continue;
+			if (n == maxblobs && count <= cc_blobs[order[n-1]].count) continue;
+			int j = (n < maxblobs) ? n++ : n-1;
+			while (j > 0 && cc_blobs[order[j-1]].count < count) {
+				order[j] = order[j-1];
+				j--;
+			}
+			order[j] = l;
+		}
+		for (int l=0; l<=ncompact; l++) cc_parent[l] = 0;
+		for (int j=0; j<n; j++) {
+			blob& b = cc_blobs[order[j]];
+			float s = 1.f/b.count;
+			b.centroid.x *= s;
+			b.centroid.y *= s;
+			b.centroid.z *= s;
+			blob_list[j] = b;
+			cc_parent[order[j]] = j+1;
+		}
+
+		if (blob_labels) {
+			for (int i=0; i<depth_width*depth_height; i++) {
+				label_back[i] = cc_parent[cc_labels[i]];
+			}
+		}
+
+		systhread_mutex_lock(blob_mutex);
+		for (int j=0; j<n; j++) blob_out[j] = blob_list[j];
+		blob_out_count = n;
+		systhread_mutex_unlock(blob_mutex);
+		new_blob_data = 1;
+
+		track_process(n);
+	}
+
+	// queue an enter/exit event (caller holds blob_mutex):
+	inline void track_event_push(t_symbol * type, const track& t) {
+		if (track_event_count >= MAX_TRACK_EVENTS) return;
+		track_event& e = track_events[track_event_count++];
+		e.type = type;
+		e.id = t.id;
+		e.pos = t.pos;
+	}
+
+	// associate this frame's blobs (blob_list) with existing tracks,
+	// greedily taking the closest predicted position within track_gate:
+	void track_process(int n) {
+		if (!tracking) return;
+
+		int track_blob[MAX_BLOBS];
+		int blob_track[MAX_BLOBS];
+		float gate2 = track_gate * track_gate;
+		for (int t=0; t<track_count; t++) track_blob[t] = -1;
+		for (int b=0; b<n; b++) blob_track[b] = -1;
+
+		while (1) {
+			float best = gate2;
+			int bt = -1, bb = -1;
+			for (int t=0; t<track_count; t++) {
+				if (track_blob[t] >= 0) continue;
+				const track& tr = tracks[t];
+				float steps = (float)(tr.missed + 1);
+				float px = tr.pos.x + tr.vel.x * steps;
+				float py = tr.pos.y + tr.vel.y * steps;
+				float pz = tr.pos.z + tr.vel.z * steps;
+				for (int b=0; b<n; b++) {
+					if (blob_track[b] >= 0) continue;
+					const vec3f& c = blob_list[b].centroid;
+					float dx = c.x - px, dy = c.y - py, dz = c.z - pz;
+					float d2 = dx*dx + dy*dy + dz*dz;
+					if (d2 < best) {
+						best = d2;
+						bt = t;
+						bb = b;
+					}
+				}
+			}
+			if (bt < 0) break;
+			track_blob[bt] = bb;
+			blob_track[bb] = bt;
+		}
+
+		t_symbol * ps_enter = gensym("enter");
+		t_symbol * ps_exit = gensym("exit");
+
+		systhread_mutex_lock(blob_mutex);
+
+		// update matched tracks, age & retire unmatched ones:
+		int kept = 0;
+		for (int t=0; t<track_count; t++) {
+			track& tr = tracks[t];
+			int b = track_blob[t];
+			if (b >= 0) {
+				const blob& bl = blob_list[b];
+				float steps = (float)(tr.missed + 1);
+				tr.vel.x = 0.5f * tr.vel.x + 0.5f * (bl.centroid.x - tr.pos.x) / steps;
+				tr.vel.y = 0.5f * tr.vel.y + 0.5f * (bl.centroid.y - tr.pos.y) / steps;
+				tr.vel.z = 0.5f * tr.vel.z + 0.5f * (bl.centroid.z - tr.pos.z) / steps;
+				tr.pos = bl.centroid;
+				tr.points = bl.count;
+				tr.missed = 0;
+			} else if (++tr.missed > track_timeout) {
+				track_event_push(ps_exit, tr);
+				continue;
+			}
+			tracks[kept++] = tr;
+		}
+		track_count = kept;
+
+		// unmatched blobs start new tracks; when the table is full, the track missed
+		// for longest makes room (those seen this frame are never more than MAX_BLOBS):
+		for (int b=0; b<n; b++) {
+			if (blob_track[b] >= 0) continue;
+			int t = track_count;
+			if (t == MAX_BLOBS) {
+				t = -1;
+				for (int k=0; k<track_count; k++) {
+					if (tracks[k].missed > 0 && (t < 0 || tracks[k].missed > tracks[t].missed)) t = k;
+				}
+				if (t < 0) break;
+				track_event_push(ps_exit, tracks[t]);
+			} else {
+				track_count++;
+			}
+			track& tr = tracks[t];
+			tr.id = track_next_id++;
+			tr.pos = blob_list[b].centroid;
+			tr.vel.x = tr.vel.y = tr.vel.z = 0.f;
+			tr.points = blob_list[b].count;
+			tr.missed = 0;
+			track_event_push(ps_enter, tr);
+		}
+
+		// publish the tracks seen this frame:
+		track_out_count = 0;
+		for (int t=0; t<track_count; t++) {
+			if (tracks[t].missed == 0) track_out[track_out_count++] = tracks[t];
+		}
+		systhread_mutex_unlock(blob_mutex);
+		new_track_data = 1;
+	}
+
+	// tracking was turned off: end the live tracks, so that their exits are still reported
+	void track_retire() {
+		t_symbol * ps_exit = gensym("exit");
+		systhread_mutex_lock(blob_mutex);
+		for (int t=0; t<track_count; t++) track_event_push(ps_exit, tracks[t]);
+		track_count = 0;
+		track_out_count = 0;
+		systhread_mutex_unlock(blob_mutex);
+		new_track_data = 1;
+	}
+
+	// report pending "enter <id> <xyz>" / "exit <id> <xyz>" events,
+	// then "update <id> <xyz> <points>" for each track seen in the latest frame:
+	void track_output() {
+		track_event events[MAX_TRACK_EVENTS];
+		track list[MAX_BLOBS];
+		t_atom a[5];
+
+		systhread_mutex_lock(blob_mutex);
+		int nevents = track_event_count;
+		for (int j=0; j<nevents; j++) events[j] = track_events[j];
+		track_event_count = 0;
+		int n = track_out_count;
+		for (int j=0; j<n; j++) list[j] = track_out[j];
+		systhread_mutex_unlock(blob_mutex);
+
+		for (int j=0; j<nevents; j++) {
+			const track_event& e = events[j];
+			atom_setlong(a+0, e.id);
+			atom_setfloat(a+1, e.pos.x);
+			atom_setfloat(a+2, e.pos.y);
+			atom_setfloat(a+3, e.pos.z);
+			outlet_anything(outlet_msg, e.type, 4, a);
+		}
+		for (int j=0; j<n; j++) {
+			const track& t = list[j];
+			atom_setlong(a+0, t.id);
+			atom_setfloat(a+1, t.pos.x);
+			atom_setfloat(a+2, t.pos.y);
+			atom_setfloat(a+3, t.pos.z);
+			atom_setlong(a+4, t.points);
+			outlet_anything(outlet_msg, gensym("update"), 5, a);
+		}
+	}
+
+	// report blobs from the message outlet, as "blobs <count>"
+	// followed by "blob <index> <points> <centroid xyz> <min xyz> <max xyz>" for each:
+	void blob_output() {
+		blob list[MAX_BLOBS];
+		t_atom a[11];
+
+		systhread_mutex_lock(blob_mutex);
+		int n = blob_out_count;
+		for (int j=0; j<n; j++) list[j] = blob_out[j];
+		systhread_mutex_unlock(blob_mutex);
+
+		if (blob_labels) {
+			atom_setsym(a, _jit_sym_jit_matrix);
+			a[1] = label_name[0];
+			outlet_anything(outlet_msg, gensym("labels"), 2, a);
+		}
+		atom_setlong(a, n);
+		outlet_anything(outlet_msg, gensym("blobs"), 1, a);
+		for (int j=0; j<n; j++) {
+			const blob& b = list[j];
+			atom_setlong(a+0, j+1);
+			atom_setlong(a+1, b.count);
+			atom_setfloat(a+2, b.centroid.x);
+			atom_setfloat(a+3, b.centroid.y);
+			atom_setfloat(a+4, b.centroid.z);
+			atom_setfloat(a+5, b.min.x);
+			atom_setfloat(a+6, b.min.y);
+			atom_setfloat(a+7, b.min.z);
+			atom_setfloat(a+8, b.max.x);
+			atom_setfloat(a+9, b.max.y);
+			atom_setfloat(a+10, b.max.z);
+			outlet_anything(outlet_msg, gensym("blob"), 11, a);
+		}
+	}
+
+	// the atoms of a key, looking inside an OpenCV matrix ({rows, cols, dt, data}) if need be:
+	static void dictionary_values(t_dictionary *d, t_symbol *key, long *argc, t_atom **argv) {
+		dictionary_getatoms(d, key, argc, argv);
+		if (*argc == 1 && atom_gettype(*argv) == A_OBJ && object_classname(atom_getobj(*argv)) == _sym_dictionary) {
+			t_dictionary *m = (t_dictionary *)atom_getobj(*argv);
+			*argc = 0;
+			*argv = NULL;
+			dictionary_getatoms(m, gensym("data"), argc, argv);
+		}
+	}
+
+	void dictionary(t_symbol *s, long argc, t_atom *argv) {
+		
+		t_dictionary	*d = dictobj_findregistered_retain(s);
+		long			numkeys = 0;
+		t_symbol		**keys = NULL;
+		int				i;
+//		int				size;
+
+		if (!d) {
+			object_error(&ob, "unable to reference dictionary named %s", s);
+			return;
+		}
+
+
+		dictionary_getkeys_ordered(d, &numkeys, &keys);
+		for (i=0; i<numkeys; i++) {
+			long	argc = 0;
+			t_atom	*argv = NULL;
+			t_symbol * key = keys[i];
+			
+			post("key %s", keys[i]->s_name);
+			
+			/*
+			key R
+			key T
+			key depth_base_and_offset
+			key depth_distortion
+			key depth_intrinsics
+			key depth_size
+			key raw_depth_size
+			key raw_rgb_size
+			key rgb_distortion
+			key rgb_intrinsics
+			key rgb_size
+			*/
+			
+			if (key == gensym("depth_base_and_offset")) {
+				dictionary_values(d, key, &argc, &argv);
+				if (argc >= 2) {
+					depth_base = atom_getfloat(argv);
+					depth_offset = atom_getfloat(argv+1);
+					object_attr_touch(&ob, gensym("depth_base"));
+					object_attr_touch(&ob, gensym("depth_offset"));
+				} else {
+					object_error(&ob, "depth_base_and_offset needs 2 values");
+				}
 			}
 
 			/*
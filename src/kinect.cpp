@@ -27,6 +27,12 @@ t_max_err kinect_notify(t_kinect *x, t_symbol *s, t_symbol *msg, void *sender, v
 	return 0;
 }
 
+// called for patch cords to & from the object; only those from its outlets matter:
+t_max_err kinect_patchlineupdate(t_kinect *x, t_object *patchline, long updatetype, t_object *src, long srcout, t_object *dst, long dstin) {
+	x->patchline_update(updatetype, src == (t_object *)x ? srcout : -1);
+	return 0;
+}
+
 void kinect_assist(t_kinect *x, void *b, long m, long a, char *s)
 {
 	if (m == ASSIST_INLET) { // inlet
@@ -88,6 +94,57 @@ void kinect_accel(t_kinect *x) {
 	x->accel();
 }
 
+void kinect_findfloor(t_kinect *x, t_symbol *s, long argc, t_atom *argv) {
+	x->findfloor(argc > 0 ? atom_getlong(argv) : 1);
+}
+
+void kinect_learnbg(t_kinect *x, long frames) {
+	x->learnbg(frames);
+}
+
+void kinect_clearbg(t_kinect *x) {
+	x->clearbg();
+}
+
+void kinect_stats(t_kinect *x) {
+	x->stats();
+}
+
+t_max_err kinect_registration_set(t_kinect *x, t_object *attr, long argc, t_atom *argv) {
+	if (argc > 0) x->set_registration(atom_getlong(argv));
+	return 0;
+}
+
+t_max_err kinect_video_format_set(t_kinect *x, t_object *attr, long argc, t_atom *argv) {
+	if (argc > 0) x->set_video_format(atom_getlong(argv));
+	return 0;
+}
+
+t_max_err kinect_depth_format_set(t_kinect *x, t_object *attr, long argc, t_atom *argv) {
+	if (argc > 0) x->set_depth_format(atom_getlong(argv));
+	return 0;
+}
+
+t_max_err kinect_group_set(t_kinect *x, t_object *attr, long argc, t_atom *argv) {
+	x->set_group(argc > 0 ? atom_getsym(argv) : NULL);
+	return 0;
+}
+
+t_max_err kinect_group_sync_set(t_kinect *x, t_object *attr, long argc, t_atom *argv) {
+	if (argc > 0) x->set_group_sync(atom_getfloat(argv));
+	return 0;
+}
+
+t_max_err kinect_depth_resolution_set(t_kinect *x, t_object *attr, long argc, t_atom *argv) {
+	if (argc > 0) x->set_depth_resolution(atom_getlong(argv));
+	return 0;
+}
+
+t_max_err kinect_video_resolution_set(t_kinect *x, t_object *attr, long argc, t_atom *argv) {
+	if (argc > 0) x->set_video_resolution(atom_getlong(argv));
+	return 0;
+}
+
 void *kinect_new(t_symbol *s, long argc, t_atom *argv)
 {
 	t_kinect *x = NULL;
@@ -105,7 +162,7 @@ void *kinect_new(t_symbol *s, long argc, t_atom *argv)
 		// apply attrs:
 		attr_args_process(x, argc, argv);
 		
-		// default attrs:
+		// default attrs (device_count comes from the shared device listing, without waiting on USB):
 		kinect_getdevlist(x);
 	}
 	return (x);
@@ -136,6 +193,7 @@ int C74_EXPORT main(void) {
 				  
 	class_addmethod(maxclass, (method)kinect_assist, "assist", A_CANT, 0);
 	class_addmethod(maxclass, (method)kinect_notify, "notify", A_CANT, 0);
+	class_addmethod(maxclass, (method)kinect_patchlineupdate, "patchlineupdate", A_CANT, 0);
 	
 	class_addmethod(maxclass, (method)kinect_bang, "bang", 0);
 	class_addmethod(maxclass, (method)kinect_getdevlist, "getdevlist", 0);
@@ -143,6 +201,10 @@ int C74_EXPORT main(void) {
 	class_addmethod(maxclass, (method)kinect_accel, "accel", 0);
 	class_addmethod(maxclass, (method)kinect_open, "open", A_GIMME, 0);
 	class_addmethod(maxclass, (method)kinect_close, "close", 0);
+	class_addmethod(maxclass, (method)kinect_findfloor, "findfloor", A_GIMME, 0);
+	class_addmethod(maxclass, (method)kinect_learnbg, "learnbg", A_DEFLONG, 0);
+	class_addmethod(maxclass, (method)kinect_clearbg, "clearbg", 0);
+	class_addmethod(maxclass, (method)kinect_stats, "stats", 0);
 	
 	class_addmethod(maxclass, (method)kinect_depth_map, "depth_map", A_GIMME, 0);
 	class_addmethod(maxclass, (method)kinect_rgb_map, "rgb_map", A_GIMME, 0);
@@ -157,6 +219,87 @@ int C74_EXPORT main(void) {
 	CLASS_ATTR_LONG(maxclass, "transform_cloud", 0, t_kinect, transform_cloud);
 	CLASS_ATTR_STYLE(maxclass, "transform_cloud", 0, "onoff");
 	
+	CLASS_ATTR_LONG(maxclass, "bg_subtract", 0, t_kinect, bg_subtract);
+	CLASS_ATTR_STYLE_LABEL(maxclass, "bg_subtract", 0, "onoff", "remove learned background from the cloud");
+	CLASS_ATTR_FLOAT(maxclass, "bg_threshold", 0, t_kinect, bg_threshold);
+	CLASS_ATTR_LABEL(maxclass, "bg_threshold", 0, "minimum distance (mm) in front of the background");
+	CLASS_ATTR_FLOAT(maxclass, "bg_sigma", 0, t_kinect, bg_sigma);
+	CLASS_ATTR_LABEL(maxclass, "bg_sigma", 0, "minimum distance (standard deviations) in front of the background");
+	CLASS_ATTR_FLOAT(maxclass, "bg_adapt", 0, t_kinect, bg_adapt);
+	CLASS_ATTR_FILTER_CLIP(maxclass, "bg_adapt", 0, 1);
+	
+	CLASS_ATTR_LONG(maxclass, "blobs", 0, t_kinect, blobs);
+	CLASS_ATTR_STYLE_LABEL(maxclass, "blobs", 0, "onoff", "report connected regions of the cloud");
+	CLASS_ATTR_LONG(maxclass, "blob_labels", 0, t_kinect, blob_labels);
+	CLASS_ATTR_STYLE_LABEL(maxclass, "blob_labels", 0, "onoff", "output the blob label matrix");
+	CLASS_ATTR_LONG(maxclass, "blob_min_points", 0, t_kinect, blob_min_points);
+	CLASS_ATTR_FILTER_MIN(maxclass, "blob_min_points", 1);
+	CLASS_ATTR_LONG(maxclass, "blob_max", 0, t_kinect, blob_max);
+	CLASS_ATTR_FILTER_CLIP(maxclass, "blob_max", 1, MAX_BLOBS);
+	CLASS_ATTR_FLOAT(maxclass, "blob_depth_step", 0, t_kinect, blob_depth_step);
+	CLASS_ATTR_LABEL(maxclass, "blob_depth_step", 0, "largest depth difference (mm) between connected neighbours");
+	CLASS_ATTR_FILTER_MIN(maxclass, "blob_depth_step", 0);
+	
+	CLASS_ATTR_LONG(maxclass, "tracking", 0, t_kinect, tracking);
+	CLASS_ATTR_STYLE_LABEL(maxclass, "tracking", 0, "onoff", "follow blobs across frames (enter/update/exit)");
+	CLASS_ATTR_FLOAT(maxclass, "track_gate", 0, t_kinect, track_gate);
+	CLASS_ATTR_LABEL(maxclass, "track_gate", 0, "furthest a track may move between frames (m)");
+	CLASS_ATTR_LONG(maxclass, "track_timeout", 0, t_kinect, track_timeout);
+	CLASS_ATTR_LABEL(maxclass, "track_timeout", 0, "frames a track survives without a matching blob");
+	
+	CLASS_ATTR_FLOAT(maxclass, "edge_threshold", 0, t_kinect, edge_threshold);
+	CLASS_ATTR_LABEL(maxclass, "edge_threshold", 0, "reject points whose depth jumps to a neighbour by more than this fraction, 0 = off");
+	CLASS_ATTR_FILTER_MIN(maxclass, "edge_threshold", 0);
+	CLASS_ATTR_LONG(maxclass, "outlier_k", 0, t_kinect, outlier_k);
+	CLASS_ATTR_LABEL(maxclass, "outlier_k", 0, "neighbours considered by statistical outlier removal, 0 = off");
+	CLASS_ATTR_FILTER_CLIP(maxclass, "outlier_k", 0, 120);
+	CLASS_ATTR_LONG(maxclass, "outlier_window", 0, t_kinect, outlier_window);
+	CLASS_ATTR_LABEL(maxclass, "outlier_window", 0, "pixel radius searched for neighbours");
+	CLASS_ATTR_FILTER_CLIP(maxclass, "outlier_window", 1, 5);
+	CLASS_ATTR_FLOAT(maxclass, "outlier_alpha", 0, t_kinect, outlier_alpha);
+	CLASS_ATTR_LABEL(maxclass, "outlier_alpha", 0, "remove points beyond mean + alpha * stddev of neighbour distance");
+	CLASS_ATTR_FLOAT(maxclass, "voxel_size", 0, t_kinect, voxel_size);
+	CLASS_ATTR_LABEL(maxclass, "voxel_size", 0, "thin the cloud to one point per voxel of this size (m), 0 = off");
+	CLASS_ATTR_FILTER_MIN(maxclass, "voxel_size", 0);
+	CLASS_ATTR_LONG(maxclass, "voxel_mode", 0, t_kinect, voxel_mode);
+	CLASS_ATTR_ENUMINDEX(maxclass, "voxel_mode", 0, "first centroid");
+	
+	CLASS_ATTR_FLOAT(maxclass, "floor_tolerance", 0, t_kinect, floor_tolerance);
+	CLASS_ATTR_LABEL(maxclass, "floor_tolerance", 0, "largest distance (m) of a floor point from the plane");
+	CLASS_ATTR_FLOAT(maxclass, "floor_angle", 0, t_kinect, floor_angle);
+	CLASS_ATTR_LABEL(maxclass, "floor_angle", 0, "largest tilt (degrees) of the floor from the accelerometer's up");
+	
+	CLASS_ATTR_LONG(maxclass, "accel_interval", 0, t_kinect, accel_interval);
+	CLASS_ATTR_LABEL(maxclass, "accel_interval", 0, "time (ms) between accelerometer readings");
+	CLASS_ATTR_FILTER_MIN(maxclass, "accel_interval", 10);
+	CLASS_ATTR_LONG(maxclass, "gravity_align", 0, t_kinect, gravity_align);
+	CLASS_ATTR_STYLE_LABEL(maxclass, "gravity_align", 0, "onoff", "level the transformed cloud using the accelerometer");
+	
+	CLASS_ATTR_LONG(maxclass, "registration", 0, t_kinect, registration);
+	CLASS_ATTR_ENUMINDEX(maxclass, "registration", 0, "software hardware table");
+	CLASS_ATTR_ACCESSORS(maxclass, "registration", NULL, kinect_registration_set);
+	CLASS_ATTR_LONG(maxclass, "profile", 0, t_kinect, profile);
+	CLASS_ATTR_STYLE_LABEL(maxclass, "profile", 0, "onoff", "time processing stages (see stats)");
+	CLASS_ATTR_SYM(maxclass, "group", 0, t_kinect, group);
+	CLASS_ATTR_LABEL(maxclass, "group", 0, "fuse clouds of all devices with this group name into one matrix");
+	CLASS_ATTR_ACCESSORS(maxclass, "group", NULL, kinect_group_set);
+	CLASS_ATTR_FLOAT(maxclass, "group_sync", 0, t_kinect, group_sync);
+	CLASS_ATTR_LABEL(maxclass, "group_sync", 0, "only fuse frames of all group devices arriving within this many ms, 0 = off");
+	CLASS_ATTR_FILTER_MIN(maxclass, "group_sync", 0);
+	CLASS_ATTR_ACCESSORS(maxclass, "group_sync", NULL, kinect_group_sync_set);
+	CLASS_ATTR_LONG(maxclass, "private_context", 0, t_kinect, private_context);
+	CLASS_ATTR_STYLE_LABEL(maxclass, "private_context", 0, "onoff", "open the device with its own driver context & event thread");
+	CLASS_ATTR_LONG(maxclass, "event_priority", 0, t_kinect, event_priority);
+	CLASS_ATTR_LABEL(maxclass, "event_priority", 0, "priority of the event thread, applied when it starts");
+	CLASS_ATTR_LONG(maxclass, "event_affinity", 0, t_kinect, event_affinity);
+	CLASS_ATTR_LABEL(maxclass, "event_affinity", 0, "affinity tag of the event thread (macOS), 0 = none; applied when it starts");
+	CLASS_ATTR_FILTER_MIN(maxclass, "event_affinity", 0);
+	CLASS_ATTR_LONG(maxclass, "lazy", 0, t_kinect, lazy);
+	CLASS_ATTR_STYLE_LABEL(maxclass, "lazy", 0, "onoff", "only compute the matrices of connected outlets & enabled features");
+	CLASS_ATTR_LONG(maxclass, "watchdog", 0, t_kinect, watchdog);
+	CLASS_ATTR_LABEL(maxclass, "watchdog", 0, "ms without frames before the device is closed & reopened, 0 = off");
+	CLASS_ATTR_FILTER_MIN(maxclass, "watchdog", 0);
+	
 	CLASS_ATTR_LONG(maxclass, "unique", 0, t_kinect, unique);
 	CLASS_ATTR_STYLE_LABEL(maxclass, "unique", 0, "onoff", "output frame only when new data is received");
 	
@@ -170,6 +313,19 @@ int C74_EXPORT main(void) {
 	CLASS_ATTR_FLOAT_ARRAY(maxclass, "depth_center", 0, t_kinect, depth_center, 2);
 	CLASS_ATTR_FLOAT(maxclass, "depth_base", 0, t_kinect, depth_base);
 	CLASS_ATTR_FLOAT(maxclass, "depth_offset", 0, t_kinect, depth_offset);
+	CLASS_ATTR_LONG(maxclass, "depth_format", 0, t_kinect, depth_format);
+	CLASS_ATTR_ENUMINDEX(maxclass, "depth_format", 0, "mm raw packed packed10");
+	CLASS_ATTR_ACCESSORS(maxclass, "depth_format", NULL, kinect_depth_format_set);
+	CLASS_ATTR_LONG(maxclass, "depth_resolution", 0, t_kinect, depth_resolution);
+	CLASS_ATTR_ENUMINDEX(maxclass, "depth_resolution", 0, "low medium high");
+	CLASS_ATTR_ACCESSORS(maxclass, "depth_resolution", NULL, kinect_depth_resolution_set);
+	
+	CLASS_ATTR_LONG(maxclass, "video_format", 0, t_kinect, video_format);
+	CLASS_ATTR_ENUMINDEX(maxclass, "video_format", 0, "rgb bayer ir ir10 ir10packed");
+	CLASS_ATTR_ACCESSORS(maxclass, "video_format", NULL, kinect_video_format_set);
+	CLASS_ATTR_LONG(maxclass, "video_resolution", 0, t_kinect, video_resolution);
+	CLASS_ATTR_ENUMINDEX(maxclass, "video_resolution", 0, "low medium high");
+	CLASS_ATTR_ACCESSORS(maxclass, "video_resolution", NULL, kinect_video_resolution_set);
 	
 	CLASS_ATTR_FLOAT_ARRAY(maxclass, "rgb_focal", 0, t_kinect, rgb_focal, 2);
 	CLASS_ATTR_FLOAT_ARRAY(maxclass, "rgb_center", 0, t_kinect, rgb_center, 2);